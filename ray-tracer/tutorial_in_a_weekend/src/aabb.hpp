@@ -8,12 +8,19 @@ public:
   Aabb() {}
   Aabb(const Point3 &a, const Point3 &b)
   {
-    minimum = a;
-    maximum = b;
+    bounds[0] = a;
+    bounds[1] = b;
   }
 
-  Point3 min() const { return minimum; }
-  Point3 max() const { return maximum; }
+  Point3 min() const { return bounds[0]; }
+  Point3 max() const { return bounds[1]; }
+
+  Point3 centroid() const { return 0.5 * (bounds[0] + bounds[1]); }
+
+  double surface_area() const {
+    auto d = bounds[1] - bounds[0];
+    return 2 * (d.x() * d.y() + d.x() * d.z() + d.y() * d.z());
+  }
 
   bool hit(const Ray& r, double t_min, double t_max) const;
   /*
@@ -37,24 +44,22 @@ public:
   */
 
 public:
-  Point3 minimum;
-  Point3 maximum;
+  // The minimum and maximum corner
+  Point3 bounds[2];
 };
 
 
 inline bool Aabb::hit(const Ray &r, double t_min, double t_max) const {
+  // The ray's sign bits pick the near and far plane, and the selects below
+  // compile to min and max, so there's no branch. A NaN from a ray lying in
+  // a slab's plane leaves the interval as it is.
   for (int a = 0; a < 3; a++) {
-    auto invD = 1.0f / r.direction()[a];
-    auto t0 = (min()[a] - r.origin()[a]) * invD;
-    auto t1 = (max()[a] - r.origin()[a]) * invD;
-    if (invD < 0.0f)
-      std::swap(t0, t1);
+    auto t0 = (bounds[r.sign[a]].e[a] - r.orig.e[a]) * r.inv_dir.e[a];
+    auto t1 = (bounds[1 - r.sign[a]].e[a] - r.orig.e[a]) * r.inv_dir.e[a];
     t_min = t0 > t_min ? t0 : t_min;
     t_max = t1 < t_max ? t1 : t_max;
-    if (t_max <= t_min)
-      return false;
   }
-  return true;
+  return t_min < t_max;
 }
 
 Aabb surrounding_box(Aabb box0, Aabb box1)
@@ -4,18 +4,28 @@
 #include "rtweekend.hpp"
 
 #include "hittable.hpp"
+#include "material.hpp"
 
 class XyRect : public Hittable {
 public:
   XyRect() {}
 
   XyRect(
-    double x0, double x1, double y0, double y1, double k, Material *mat
+    real x0, real x1, real y0, real y1, real k, Material *mat
   )
     : x0(x0), x1(x1), y0(y0), y1(y1), k(k), material(mat) {};
 
   virtual bool hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const override;
 
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
+
+  virtual void finalize_hit(const Ray &r, HitRecord &rec) const override;
+
+  virtual double emitted_power() const override
+  {
+    return pi * (x1 - x0) * (y1 - y0) * luminance(material->emission());
+  }
+
   virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override
   {
     // The bounding box must have non-zero width in each dimension, so pad the Z
@@ -25,7 +35,7 @@ public:
   }
 
 public:
-  double x0, x1, y0, y1, k;
+  real x0, x1, y0, y1, k;
   Material *material;
 };
 
@@ -40,16 +50,30 @@ bool XyRect::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const
   if(x < x0 || x > x1 || y < y0 || y > y1)
     return false;
 
-  rec.u = (x - x0) / (x1 - x0);
-  rec.v = (y - y0) / (y1 - y0);
-  rec.t = t;
+  rec.defer(t, this);
+  return true;
+}
+
+void XyRect::finalize_hit(const Ray &r, HitRecord &rec) const
+{
+  rec.p = r.at(rec.t);
+  rec.u = (rec.p.x() - x0) / (x1 - x0);
+  rec.v = (rec.p.y() - y0) / (y1 - y0);
 
   auto outward_normal = Vec3(0, 0, 1);
   rec.set_face_normal(r, outward_normal);
   rec.material = material;
-  rec.p = r.at(t);
+}
 
-  return true;
+bool XyRect::occluded(const Ray &r, double t_min, double t_max) const
+{
+  auto t = (k-r.origin().z()) / r.direction().z();
+  if(t < t_min || t > t_max)
+    return false;
+
+  auto x = r.origin().x() + t*r.direction().x();
+  auto y = r.origin().y() + t*r.direction().y();
+  return x >= x0 && x <= x1 && y >= y0 && y <= y1;
 }
 
 class XzRect : public Hittable {
@@ -57,12 +81,21 @@ public:
   XzRect() {}
 
   XzRect(
-    double x0, double x1, double z0, double z1, double k, Material *mat
+    real x0, real x1, real z0, real z1, real k, Material *mat
   )
     : x0(x0), x1(x1), z0(z0), z1(z1), k(k), material(mat) {};
 
   virtual bool hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const override;
 
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
+
+  virtual void finalize_hit(const Ray &r, HitRecord &rec) const override;
+
+  virtual double emitted_power() const override
+  {
+    return pi * (x1 - x0) * (z1 - z0) * luminance(material->emission());
+  }
+
   virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override
   {
     // The bounding box must have non-zero width in each dimension, so pad the Z
@@ -74,10 +107,12 @@ public:
   virtual double pdf_value(const Point3 &o, const Vec3 &v) const
   {
     HitRecord rec;
-    if(!this->hit(Ray(o, v), 0.001, infinity, rec)) {
+    Ray ray(o, v);
+    if(!this->hit(ray, 0.001, infinity, rec)) {
       // std::cout << "XzRect::pdf_value(" << o << ", " << v << ") -> 0 (not hit)" << std::endl;
       return 0;
     }
+    rec.resolve(ray);
 
     auto area = (x1 - x0) * (z1 - z0);
     auto distance_squared = rec.t * rec.t * v.length_squared();
@@ -93,7 +128,7 @@ public:
   }
 
 public:
-  double x0, x1, z0, z1, k;
+  real x0, x1, z0, z1, k;
   Material *material;
 };
 
@@ -108,16 +143,30 @@ bool XzRect::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const
   if(x < x0 || x > x1 || z < z0 || z > z1)
     return false;
 
-  rec.u = (x - x0) / (x1 - x0);
-  rec.v = (z - z0) / (z1 - z0);
-  rec.t = t;
+  rec.defer(t, this);
+  return true;
+}
+
+void XzRect::finalize_hit(const Ray &r, HitRecord &rec) const
+{
+  rec.p = r.at(rec.t);
+  rec.u = (rec.p.x() - x0) / (x1 - x0);
+  rec.v = (rec.p.z() - z0) / (z1 - z0);
 
   auto outward_normal = Vec3(0, 1, 0);
   rec.set_face_normal(r, outward_normal);
   rec.material = material;
-  rec.p = r.at(t);
+}
 
-  return true;
+bool XzRect::occluded(const Ray &r, double t_min, double t_max) const
+{
+  auto t = (k-r.origin().y()) / r.direction().y();
+  if(t < t_min || t > t_max)
+    return false;
+
+  auto x = r.origin().x() + t*r.direction().x();
+  auto z = r.origin().z() + t*r.direction().z();
+  return x >= x0 && x <= x1 && z >= z0 && z <= z1;
 }
 
 class YzRect : public Hittable {
@@ -125,12 +174,21 @@ public:
   YzRect() {}
 
   YzRect(
-    double y0, double y1, double z0, double z1, double k, Material *mat
+    real y0, real y1, real z0, real z1, real k, Material *mat
   )
     : y0(y0), y1(y1), z0(z0), z1(z1), k(k), material(mat) {};
 
   virtual bool hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const override;
 
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
+
+  virtual void finalize_hit(const Ray &r, HitRecord &rec) const override;
+
+  virtual double emitted_power() const override
+  {
+    return pi * (y1 - y0) * (z1 - z0) * luminance(material->emission());
+  }
+
   virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override
   {
     // The bounding box must have non-zero width in each dimension, so pad the Z
@@ -140,7 +198,7 @@ public:
   }
 
 public:
-  double y0, y1, z0, z1, k;
+  real y0, y1, z0, z1, k;
   Material *material;
 };
 
@@ -155,16 +213,30 @@ bool YzRect::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const
   if(y < y0 || y > y1 || z < z0 || z > z1)
     return false;
 
-  rec.u = (y - y0) / (y1 - y0);
-  rec.v = (z - z0) / (z1 - z0);
-  rec.t = t;
+  rec.defer(t, this);
+  return true;
+}
+
+void YzRect::finalize_hit(const Ray &r, HitRecord &rec) const
+{
+  rec.p = r.at(rec.t);
+  rec.u = (rec.p.y() - y0) / (y1 - y0);
+  rec.v = (rec.p.z() - z0) / (z1 - z0);
 
   auto outward_normal = Vec3(1, 0, 0);
   rec.set_face_normal(r, outward_normal);
   rec.material = material;
-  rec.p = r.at(t);
+}
 
-  return true;
+bool YzRect::occluded(const Ray &r, double t_min, double t_max) const
+{
+  auto t = (k-r.origin().x()) / r.direction().x();
+  if(t < t_min || t > t_max)
+    return false;
+
+  auto y = r.origin().y() + t*r.direction().y();
+  auto z = r.origin().z() + t*r.direction().z();
+  return y >= y0 && y <= y1 && z >= z0 && z <= z1;
 }
 
 #endif
@@ -0,0 +1,135 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "hittable.hpp"
+#include "material.hpp"
+#include "texture.hpp"
+
+// A bump allocator. Objects are placed one after another in large blocks and
+// live until the arena is cleared or destroyed, which runs their destructors
+// in reverse order of creation and frees the blocks in one go. Not thread
+// safe.
+class Arena {
+public:
+  Arena(size_t block_size = 64 * 1024) : block_size(block_size), next(nullptr), left(0) {}
+  ~Arena() { clear(); }
+
+  Arena(const Arena&) = delete;
+  Arena &operator=(const Arena&) = delete;
+  Arena(Arena &&other) noexcept
+    : block_size(other.block_size), blocks(std::move(other.blocks)),
+      destructors(std::move(other.destructors)),
+      next(std::exchange(other.next, nullptr)), left(std::exchange(other.left, 0)) {}
+  Arena &operator=(Arena &&other) noexcept
+  {
+    if(this != &other) {
+      clear();
+      block_size = other.block_size;
+      blocks = std::move(other.blocks);
+      destructors = std::move(other.destructors);
+      next = std::exchange(other.next, nullptr);
+      left = std::exchange(other.left, 0);
+    }
+    return *this;
+  }
+
+  template<typename T, typename... Args>
+  T *create(Args&&... args)
+  {
+    auto object = new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if(!std::is_trivially_destructible<T>::value)
+      destructors.push_back({object, [](void *p) { static_cast<T*>(p)->~T(); }});
+    return object;
+  }
+
+  // Destroys every object and frees all memory
+  void clear()
+  {
+    for(auto d = destructors.rbegin(); d != destructors.rend(); ++d)
+      d->destroy(d->object);
+    destructors.clear();
+    blocks.clear();
+    next = nullptr;
+    left = 0;
+  }
+
+  size_t block_count() const { return blocks.size(); }
+
+private:
+  void *allocate(size_t size, size_t alignment)
+  {
+    auto padding = (alignment - reinterpret_cast<uintptr_t>(next) % alignment) % alignment;
+    if(!next || padding + size > left) {
+      // Objects larger than a block get a block of their own
+      auto bytes = std::max(block_size, size + alignment);
+      blocks.emplace_back(new char[bytes]);
+      next = blocks.back().get();
+      left = bytes;
+      padding = (alignment - reinterpret_cast<uintptr_t>(next) % alignment) % alignment;
+    }
+    auto p = next + padding;
+    next += padding + size;
+    left -= padding + size;
+    return p;
+  }
+
+  struct Destructor {
+    void *object;
+    void (*destroy)(void*);
+  };
+
+  size_t block_size;
+  std::vector<std::unique_ptr<char[]>> blocks;
+  std::vector<Destructor> destructors;
+  char *next;
+  size_t left;
+};
+
+// Owns everything a scene is made of, with one arena per kind of object so
+// that objects of a kind lie next to each other in memory: textures,
+// materials, and the geometry and acceleration structures that refer to
+// them.
+class SceneArena {
+public:
+  template<typename T, typename... Args>
+  T *create(Args&&... args)
+  {
+    return arena_for<T>().template create<T>(std::forward<Args>(args)...);
+  }
+
+  void clear()
+  {
+    // Geometry refers to materials, which refer to textures
+    objects.clear();
+    materials.clear();
+    textures.clear();
+  }
+
+public:
+  Arena textures;
+  Arena materials;
+  Arena objects;
+
+private:
+  template<typename T>
+  Arena &arena_for()
+  {
+    if constexpr(std::is_base_of<Texture, T>::value)
+      return textures;
+    else if constexpr(std::is_base_of<Material, T>::value)
+      return materials;
+    else
+      return objects;
+  }
+};
+
+#endif
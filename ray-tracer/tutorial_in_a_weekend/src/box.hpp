@@ -1,10 +1,11 @@
 #ifndef BOX_HPP
 #define BOX_HPP
 
+#include <array>
+
 #include "rtweekend.hpp"
 
 #include "aarect.hpp"
-#include "hittable_list.hpp"
 
 class Box : public Hittable
 {
@@ -14,6 +15,8 @@ public:
 
   virtual bool hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const override;
 
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
+
   virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override {
     output_box = Aabb(box_min, box_max);
     return true;
@@ -22,7 +25,15 @@ public:
 public:
   Point3 box_min;
   Point3 box_max;
-  HittableList sides;
+  // Stored in the box itself so a box is a single allocation
+  XyRect xy_sides[2];
+  XzRect xz_sides[2];
+  YzRect yz_sides[2];
+
+private:
+  std::array<const Hittable*, 6> sides() const {
+    return {&xy_sides[0], &xy_sides[1], &xz_sides[0], &xz_sides[1], &yz_sides[0], &yz_sides[1]};
+  }
 };
 
 Box::Box(const Point3 &p0, const Point3 &p1, Material *material)
@@ -30,18 +41,33 @@ Box::Box(const Point3 &p0, const Point3 &p1, Material *material)
   box_min = p0;
   box_max = p1;
 
-  sides.add(new XyRect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), material));
-  sides.add(new XyRect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), material));
+  xy_sides[0] = XyRect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), material);
+  xy_sides[1] = XyRect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), material);
 
-  sides.add(new XzRect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), material));
-  sides.add(new XzRect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), material));
+  xz_sides[0] = XzRect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), material);
+  xz_sides[1] = XzRect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), material);
 
-  sides.add(new YzRect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), material));
-  sides.add(new YzRect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), material));
+  yz_sides[0] = YzRect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), material);
+  yz_sides[1] = YzRect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), material);
 }
 
 bool Box::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const {
-  return sides.hit(r, t_min, t_max, rec);
+  bool hit_anything = false;
+  for(auto side : sides()) {
+    if(side->hit(r, t_min, t_max, rec)) {
+      hit_anything = true;
+      t_max = rec.t;
+    }
+  }
+  return hit_anything;
+}
+
+bool Box::occluded(const Ray &r, double t_min, double t_max) const {
+  for(auto side : sides()) {
+    if(side->occluded(r, t_min, t_max))
+      return true;
+  }
+  return false;
 }
 
 #endif
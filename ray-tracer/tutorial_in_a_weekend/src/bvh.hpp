@@ -2,6 +2,11 @@
 #define BVH_HPP
 
 #include <algorithm>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/task_group.h>
 
 #include "rtweekend.hpp"
 
@@ -13,18 +18,23 @@ class BvhNode : public Hittable {
 public:
   BvhNode();
 
-  BvhNode(const HittableList &list, double time0, double time1)
-    : BvhNode(list.objects, 0, list.objects.size(), time0, time1)
-  {}
+  BvhNode(const HittableList &list, double time0, double time1);
+  // Builds over objects[start, end), reordering that range in place
   BvhNode(
-    const std::vector<Hittable*> &src_objects,
+    std::vector<Hittable*> &objects,
     size_t start, size_t end, double time0, double time1
   );
+  virtual ~BvhNode();
+
+  BvhNode(const BvhNode&) = delete;
+  BvhNode &operator=(const BvhNode&) = delete;
 
   virtual bool hit(
     const Ray &r, double t_min, double t_max, HitRecord &rec
   ) const override;
 
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
+
   virtual bool bounding_box(
     double time0, double time1, Aabb &output_box
   ) const override;
@@ -33,6 +43,19 @@ public:
   Hittable *left;
   Hittable *right;
   Aabb box;
+  // Axis left and right were split along, left holding the lower side. Rays
+  // heading down that axis visit right first.
+  int axis = 0;
+
+private:
+  // Whether left and right are nodes this one allocated, rather than objects
+  // of the list it was built over
+  bool owns_children = false;
+
+  void build(
+    std::vector<Hittable*> &objects,
+    size_t start, size_t end, double time0, double time1
+  );
 };
 
 bool BvhNode::bounding_box(double time0, double time1, Aabb &output_box) const
@@ -41,64 +64,264 @@ bool BvhNode::bounding_box(double time0, double time1, Aabb &output_box) const
   return true;
 }
 
-inline bool box_compare(const Hittable *a, const Hittable *b, int axis)
-{
-  Aabb box_a;
-  Aabb box_b;
+// Number of buckets the centroids are binned into when evaluating the
+// surface area heuristic. Beyond ~16 the split quality barely improves.
+const int sah_bucket_count = 12;
 
-  if(!a->bounding_box(0,0, box_a) || !b->bounding_box(0,0, box_b))
-    std::cerr << "No bounding box in bvh_node constructor.\n";
+// Relative cost of one extra level of traversal compared to one object
+// intersection, used by the surface area heuristic.
+const double sah_traversal_cost = 0.125;
 
-  return box_a.min().e[axis] < box_b.min().e[axis];
-}
+// Ranges larger than this are split across TBB tasks while building
+const size_t bvh_parallel_threshold = 4096;
+
+struct SahBucket {
+  size_t count = 0;
+  Aabb bounds;
+
+  void add(const Aabb &box) {
+    bounds = count ? surrounding_box(bounds, box) : box;
+    count++;
+  }
+
+  void merge(const SahBucket &other) {
+    if(!other.count)
+      return;
+    bounds = count ? surrounding_box(bounds, other.bounds) : other.bounds;
+    count += other.count;
+  }
+};
+
+// Bounds of a range of boxes and of their centroids
+struct SahBounds {
+  SahBucket boxes;
+  SahBucket centroids;
+
+  void add(const Aabb &box) {
+    auto c = box.centroid();
+    boxes.add(box);
+    centroids.add(Aabb(c, c));
+  }
 
+  void merge(const SahBounds &other) {
+    boxes.merge(other.boxes);
+    centroids.merge(other.centroids);
+  }
+};
+
+struct SahBins {
+  SahBucket buckets[sah_bucket_count];
+
+  void merge(const SahBins &other) {
+    for(int b = 0; b < sah_bucket_count; b++)
+      buckets[b].merge(other.buckets[b]);
+  }
+};
+
+struct SahSplit {
+  size_t mid;  // Index of the first item in the right half
+  int axis;    // Axis the items were partitioned along
+  double cost; // Estimated cost of the split, in object intersections
+};
 
-bool box_x_compare(const Hittable *a, const Hittable *b)
+// Runs accumulate(range, Result()) over [start, end), split across TBB
+// tasks when the range is large enough to be worth it.
+template<typename Result, typename Accumulate>
+Result bvh_reduce(size_t start, size_t end, Accumulate accumulate)
 {
-  return box_compare(a, b, 0);
+  tbb::blocked_range<size_t> range(start, end, bvh_parallel_threshold);
+  if(end - start <= bvh_parallel_threshold)
+    return accumulate(range, Result());
+
+  return tbb::parallel_reduce(
+    range, Result(), accumulate,
+    [](Result a, const Result &b) { a.merge(b); return a; }
+  );
 }
 
-bool box_y_compare(const Hittable *a, const Hittable *b)
+// Partitions items[start, end) in place using a binned surface area
+// heuristic. box_of(item) must return the bounding box of an item.
+template<typename T, typename BoxOf>
+SahSplit sah_partition(std::vector<T> &items, size_t start, size_t end, BoxOf box_of)
 {
-  return box_compare(a, b, 1);
+  auto totals = bvh_reduce<SahBounds>(
+    start, end,
+    [&](const tbb::blocked_range<size_t> &r, SahBounds result) {
+      for(size_t i = r.begin(); i < r.end(); i++)
+        result.add(box_of(items[i]));
+      return result;
+    }
+  );
+  const auto &bounds = totals.boxes.bounds;
+  const auto &centroid_bounds = totals.centroids.bounds;
+
+  // Split along the axis where the centroids are spread out the most
+  auto extent = centroid_bounds.max() - centroid_bounds.min();
+  int axis = 0;
+  if(extent.y() > extent[axis])
+    axis = 1;
+  if(extent.z() > extent[axis])
+    axis = 2;
+
+  SahSplit median = {start + (end - start) / 2, axis, infinity};
+
+  if(extent[axis] <= 0) {
+    // All centroids coincide, so no split is better than any other
+    return median;
+  }
+
+  auto bucket_of = [&](const Aabb &box) {
+    auto offset = (box.centroid()[axis] - centroid_bounds.min()[axis]) / extent[axis];
+    auto b = static_cast<int>(sah_bucket_count * offset);
+    return b < sah_bucket_count ? b : sah_bucket_count - 1;
+  };
+
+  auto bins = bvh_reduce<SahBins>(
+    start, end,
+    [&](const tbb::blocked_range<size_t> &r, SahBins result) {
+      for(size_t i = r.begin(); i < r.end(); i++) {
+        Aabb box = box_of(items[i]);
+        result.buckets[bucket_of(box)].add(box);
+      }
+      return result;
+    }
+  );
+  const auto &buckets = bins.buckets;
+
+  // Sweep from the right to get the bounds and counts of every right half,
+  // then from the left evaluating the cost of splitting after each bucket.
+  SahBucket right[sah_bucket_count];
+  right[sah_bucket_count - 1] = buckets[sah_bucket_count - 1];
+  for(int b = sah_bucket_count - 2; b > 0; b--) {
+    right[b] = buckets[b];
+    right[b].merge(right[b + 1]);
+  }
+
+  int best_split = -1;
+  double best_cost = infinity;
+  SahBucket left;
+  for(int b = 0; b < sah_bucket_count - 1; b++) {
+    left.merge(buckets[b]);
+    if(!left.count || !right[b + 1].count)
+      continue;
+
+    auto cost = sah_traversal_cost + (
+      left.count * left.bounds.surface_area()
+      + right[b + 1].count * right[b + 1].bounds.surface_area()
+    ) / bounds.surface_area();
+
+    if(cost < best_cost) {
+      best_cost = cost;
+      best_split = b;
+    }
+  }
+
+  if(best_split < 0)
+    return median;
+
+  auto split = std::partition(
+    items.begin() + start,
+    items.begin() + end,
+    [&](const T &item) { return bucket_of(box_of(item)) <= best_split; }
+  );
+
+  return {static_cast<size_t>(split - items.begin()), axis, best_cost};
+}
+
+// Partitions items[start, end) in place into halves of equal size, split at
+// the median centroid along the axis where the centroids are spread out
+// the most. Unlike a SAH split this always halves the items, so it bounds
+// the depth of the tree below. box_of(item) must return the bounding box
+// of an item.
+template<typename T, typename BoxOf>
+SahSplit median_partition(std::vector<T> &items, size_t start, size_t end, BoxOf box_of)
+{
+  Point3 lo(infinity, infinity, infinity), hi(-infinity, -infinity, -infinity);
+  for(size_t i = start; i < end; i++) {
+    auto c = box_of(items[i]).centroid();
+    for(int a = 0; a < 3; a++) {
+      lo[a] = std::min(lo[a], c[a]);
+      hi[a] = std::max(hi[a], c[a]);
+    }
+  }
+  auto extent = hi - lo;
+  int axis = 0;
+  if(extent.y() > extent[axis])
+    axis = 1;
+  if(extent.z() > extent[axis])
+    axis = 2;
+
+  auto mid = start + (end - start) / 2;
+  std::nth_element(
+    items.begin() + start, items.begin() + mid, items.begin() + end,
+    [&](const T &a, const T &b) { return box_of(a).centroid()[axis] < box_of(b).centroid()[axis]; }
+  );
+  return {mid, axis, 0};
 }
 
-bool box_z_compare(const Hittable *a, const Hittable *b)
+BvhNode::BvhNode(const HittableList &list, double time0, double time1)
 {
-  return box_compare(a, b, 2);
+  // The objects are reordered while building, so take a single copy here
+  // rather than at every level.
+  auto objects = list.objects;
+  build(objects, 0, objects.size(), time0, time1);
 }
 
 BvhNode::BvhNode(
-  const std::vector<Hittable*> &src_objects,
+  std::vector<Hittable*> &objects,
   size_t start, size_t end, double time0, double time1
 )
 {
-  auto objects = src_objects; // Create a modifiable array of the source scene objects
-
-  int axis = random_int(0, 2);
-  auto comparator = (axis == 0) ?
-    box_x_compare
-    : (axis == 1) ? box_y_compare
-    : box_z_compare;
+  build(objects, start, end, time0, time1);
+}
 
+void BvhNode::build(
+  std::vector<Hittable*> &objects,
+  size_t start, size_t end, double time0, double time1
+)
+{
   size_t object_span = end - start;
 
   if (object_span == 1) {
     left = right = objects[start];
   } else if (object_span == 2) {
-    if (comparator(objects[start], objects[start+1])) {
-      left = objects[start];
-      right = objects[start+1];
-    } else {
-      left = objects[start+1];
-      right = objects[start];
+    Aabb box_a, box_b;
+    objects[start]->bounding_box(time0, time1, box_a);
+    objects[start+1]->bounding_box(time0, time1, box_b);
+    auto offset = box_b.centroid() - box_a.centroid();
+    for(int a = 1; a < 3; a++) {
+      if(fabs(offset[a]) > fabs(offset[axis]))
+        axis = a;
     }
+    left = objects[start];
+    right = objects[start+1];
+    if(offset[axis] < 0)
+      std::swap(left, right);
   } else {
-    std::sort(objects.begin() + start, objects.begin() + end, comparator);
+    auto split = sah_partition(
+      objects, start, end,
+      [time0, time1](const Hittable *object) {
+        Aabb box;
+        if(!object->bounding_box(time0, time1, box))
+          std::cerr << "No bounding box in bvh_node constructor.\n";
+        return box;
+      }
+    );
+    auto mid = split.mid;
+    axis = split.axis;
 
-    auto mid = start + object_span/2;
-    left = new BvhNode(objects, start, mid, time0, time1);
-    right = new BvhNode(objects, mid, end, time0, time1);
+    owns_children = true;
+    if(object_span > bvh_parallel_threshold) {
+      // The halves are disjoint ranges of objects, so they can be built
+      // concurrently.
+      tbb::task_group tasks;
+      tasks.run([&] { left = new BvhNode(objects, start, mid, time0, time1); });
+      right = new BvhNode(objects, mid, end, time0, time1);
+      tasks.wait();
+    } else {
+      left = new BvhNode(objects, start, mid, time0, time1);
+      right = new BvhNode(objects, mid, end, time0, time1);
+    }
   }
 
   Aabb box_left, box_right;
@@ -112,15 +335,36 @@ BvhNode::BvhNode(
   box = surrounding_box(box_left, box_right);
 }
 
+BvhNode::~BvhNode()
+{
+  if(owns_children) {
+    delete left;
+    delete right;
+  }
+}
+
 bool BvhNode::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const
 {
   if(!box.hit(r, t_min, t_max))
     return false;
 
-  bool hit_left = left->hit(r, t_min, t_max, rec);
-  bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+  // Nearest child first, so the far one is tested against a shorter ray
+  auto first = r.sign[axis] ? right : left;
+  auto second = r.sign[axis] ? left : right;
+  bool hit_first = first->hit(r, t_min, t_max, rec);
+  bool hit_second = second->hit(r, t_min, hit_first ? rec.t : t_max, rec);
+
+  return hit_first || hit_second;
+}
+
+bool BvhNode::occluded(const Ray &r, double t_min, double t_max) const
+{
+  if(!box.hit(r, t_min, t_max))
+    return false;
 
-  return hit_left || hit_right;
+  auto first = r.sign[axis] ? right : left;
+  auto second = r.sign[axis] ? left : right;
+  return first->occluded(r, t_min, t_max) || second->occluded(r, t_min, t_max);
 }
 
 #endif
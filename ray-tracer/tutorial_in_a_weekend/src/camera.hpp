@@ -36,6 +36,10 @@ public:
     this->time1 = time1;
   }
 
+  // Whether all rays start from the same point, which makes them coherent
+  // enough to trace in packets
+  bool is_pinhole() const { return lens_radius == 0; }
+
   Ray get_ray(double s, double t) const {
     Vec3 rd = lens_radius * random_in_unit_disk();
     Vec3 offset = u * rd.x() + v * rd.y();
@@ -43,7 +47,7 @@ public:
     return Ray(
       origin + offset,
       lower_left_corner + s * horizontal + t * vertical - origin - offset,
-      random_double(time0, time1)
+      time0 + (time1 - time0) * sample_1d()
     );
   }
 
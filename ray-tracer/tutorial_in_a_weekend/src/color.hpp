@@ -16,11 +16,22 @@ Color clamp_color(const Color& color, double maxval)
   return color * ratio;
 }
 
-bool is_nan(Color &color)
+bool is_nan(const Color &color)
 {
   return (color[0] != color[0]) || (color[1] != color[1]) || (color[2] != color[2]);
 }
 
+bool is_black(const Color &color)
+{
+  return color[0] == 0 && color[1] == 0 && color[2] == 0;
+}
+
+// Perceived brightness of a linear RGB color (Rec. 709 weights)
+double luminance(const Color &color)
+{
+  return 0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2];
+}
+
 void color_adjust_nan(Color &color)
 {
   if (color[0] != color[0])
@@ -81,6 +81,7 @@ bool ConstantMedium::hit(const Ray &ray, double t_min, double t_max, HitRecord &
   rec.normal = Vec3(1, 0, 0);  // arbitrary
   rec.front_face = true;       // also arbitrary
   rec.material = phase_function;
+  rec.deferred = false;
 
   return true;
 }
@@ -8,10 +8,14 @@
 #include "aabb.hpp"
 
 class Material;
+class Hittable;
 
+// Primitives only record t and themselves while a ray is traversed; the
+// point, normal, texture coordinates and material are filled in by resolve
+// once the closest hit is known.
 class HitRecord {
 public:
-  HitRecord() : u(-1), v(-1), material(nullptr) {}
+  HitRecord() : u(-1), v(-1), material(nullptr), object(nullptr), primitive(0), deferred(false) {}
 
   inline void set_face_normal(const Ray &r, const Vec3 &outward_normal)
   {
@@ -19,14 +23,32 @@ public:
     normal = front_face ? outward_normal : -outward_normal;
   }
 
+  // Records a hit at t on object, leaving the shading data for resolve
+  inline void defer(real hit_t, const Hittable *hit_object)
+  {
+    t = hit_t;
+    object = hit_object;
+    deferred = true;
+  }
+
+  // Fills in the shading data of a deferred hit. r must be the ray, in the
+  // object's own space, that was passed to the hit call.
+  inline void resolve(const Ray &r);
+
 public:
   Point3 p;
   Vec3 normal;
-  double t;
+  real t;
   bool front_face;
   // For texture mapping
-  double u, v;
+  real u, v;
   Material *material;
+  // The primitive that was hit
+  const Hittable *object;
+  // Which of object's parts was hit, for objects made of several
+  uint32_t primitive;
+  // Whether the fields past t still have to be filled in by resolve
+  bool deferred;
 };
 
 inline std::ostream& operator<<(std::ostream &out, const HitRecord &rec)
@@ -34,23 +56,61 @@ inline std::ostream& operator<<(std::ostream &out, const HitRecord &rec)
   return out << "HitRecord(" << rec.p << ", " << rec.normal << ", " << rec.material << ")";
 }
 
+// Most rays a RayPacket can hold
+const int max_packet_size = 16;
+
+// Rays intersected together by hit_packet. They should be coherent, like
+// the camera rays through one pixel, for the packet to pay off.
+struct RayPacket {
+  int size;
+  Ray rays[max_packet_size];
+};
+
 
 class Hittable {
 public:
-  void setName(std::string n) {name = n;}
+  virtual ~Hittable() {}
   virtual bool hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const = 0;
+  // Whether anything lies along the ray within (t_min, t_max). Unlike hit
+  // this may stop at the first intersection found and fills in no shading
+  // data, so shadow rays should prefer it.
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const {
+    HitRecord rec;
+    return hit(r, t_min, t_max, rec);
+  }
+  // Intersects every ray in the packet, setting hits[k] and recs[k] the way
+  // hit would for packet.rays[k]. Acceleration structures override this to
+  // share the traversal between the rays.
+  virtual void hit_packet(
+    const RayPacket &packet, double t_min, double t_max, HitRecord recs[], bool hits[]
+  ) const {
+    for(int k = 0; k < packet.size; k++)
+      hits[k] = hit(packet.rays[k], t_min, t_max, recs[k]);
+  }
   virtual bool bounding_box(double time0, double time1, Aabb &output_box) const = 0;
+  // Fills in the shading data of a hit this object deferred
+  virtual void finalize_hit(const Ray &r, HitRecord &rec) const {}
   virtual double pdf_value(const Point3 &o, const Vec3 &v) const {
     return 0.0;
   }
   virtual Vec3 random(const Vec3 &o) const {
     return Vec3(1, 0, 0);
   }
-
-public:
-  std::string name;
+  // Relative amount of light the object gives off, for picking which light
+  // to sample. Objects that can't tell all weigh the same.
+  virtual double emitted_power() const {
+    return 1.0;
+  }
 };
 
+inline void HitRecord::resolve(const Ray &r)
+{
+  if(!deferred)
+    return;
+  deferred = false;
+  object->finalize_hit(r, *this);
+}
+
 class Translate : public Hittable
 {
 public:
@@ -61,6 +121,14 @@ public:
     const Ray &ray, double t_min, double t_max, HitRecord &rec
   ) const override;
 
+  virtual bool occluded(const Ray &ray, double t_min, double t_max) const override
+  {
+    Ray moved_ray(ray.origin() - offset, ray.direction(), ray.time());
+    return ptr->occluded(moved_ray, t_min, t_max);
+  }
+
+  virtual double emitted_power() const override { return ptr->emitted_power(); }
+
   virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override;
 
 public:
@@ -75,6 +143,8 @@ bool Translate::hit(const Ray &ray, double t_min, double t_max, HitRecord &rec)
   if(!ptr->hit(moved_ray, t_min, t_max, rec))
     return false;
 
+  // Only the moved ray can shade the hit, so it can't be deferred past here
+  rec.resolve(moved_ray);
   rec.p += offset;
   rec.set_face_normal(moved_ray, rec.normal);
 
@@ -103,6 +173,13 @@ public:
     const Ray &ray, double t_min, double t_max, HitRecord &rec
   ) const override;
 
+  virtual bool occluded(const Ray &ray, double t_min, double t_max) const override
+  {
+    return ptr->occluded(rotate(ray), t_min, t_max);
+  }
+
+  virtual double emitted_power() const override { return ptr->emitted_power(); }
+
   virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override
   {
     output_box = bbox;
@@ -115,6 +192,10 @@ public:
   double cos_theta;
   bool hasbox;
   Aabb bbox;
+
+private:
+  // Takes a world space ray into the object space of ptr
+  Ray rotate(const Ray &ray) const;
 };
 
 RotateY::RotateY(Hittable *p, double angle) : ptr(p)
@@ -150,7 +231,8 @@ RotateY::RotateY(Hittable *p, double angle) : ptr(p)
   bbox = Aabb(min, max);
 }
 
-bool RotateY::hit(const Ray &ray, double t_min, double t_max, HitRecord &rec) const {
+Ray RotateY::rotate(const Ray &ray) const
+{
   auto origin = ray.origin();
   auto direction = ray.direction();
 
@@ -160,11 +242,17 @@ bool RotateY::hit(const Ray &ray, double t_min, double t_max, HitRecord &rec) co
   direction[0] = cos_theta * ray.direction()[0] - sin_theta * ray.direction()[2];
   direction[2] = sin_theta * ray.direction()[0] + cos_theta * ray.direction()[2];
 
-  Ray rotated_ray(origin, direction, ray.time());
+  return Ray(origin, direction, ray.time());
+}
+
+bool RotateY::hit(const Ray &ray, double t_min, double t_max, HitRecord &rec) const {
+  Ray rotated_ray = rotate(ray);
 
   if(!ptr->hit(rotated_ray, t_min, t_max, rec))
     return false;
 
+  rec.resolve(rotated_ray);
+
   auto p = rec.p;
   auto normal = rec.normal;
 
@@ -190,10 +278,19 @@ public:
     if (!ptr->hit(r, t_min, t_max, rec))
       return false;
 
+    rec.resolve(r);
     rec.front_face = !rec.front_face;
     return true;
   }
 
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override {
+    return ptr->occluded(r, t_min, t_max);
+  }
+
+  virtual double emitted_power() const override {
+    return ptr->emitted_power();
+  }
+
   virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override {
     return ptr->bounding_box(time0, time1, output_box);
   }
@@ -18,6 +18,7 @@ public:
   virtual bool hit(
     const Ray &r, double t_min, double t_max, HitRecord &rec
   ) const override;
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
   virtual bool bounding_box(
     double time0, double time1, Aabb &output_box
   ) const override;
@@ -44,6 +45,15 @@ bool HittableList::hit(const Ray &r, double t_min, double t_max, HitRecord &rec)
   return hit_anything;
 }
 
+bool HittableList::occluded(const Ray &r, double t_min, double t_max) const {
+  for(const auto &object : objects) {
+    if(object->occluded(r, t_min, t_max))
+      return true;
+  }
+
+  return false;
+}
+
 bool HittableList::bounding_box(double time0, double time1, Aabb &output_box) const {
   if (objects.empty()) return false;
 
@@ -88,6 +88,7 @@ bool ImagePlane::hit(const Ray &ray, double t_min, double t_max, HitRecord &rec)
     rec.p = ray.at(t);
     rec.set_face_normal(ray, normal);
     rec.material = material;
+    rec.deferred = false;
     return true;
   }
 
@@ -98,6 +99,7 @@ bool ImagePlane::hit(const Ray &ray, double t_min, double t_max, HitRecord &rec)
     rec.p = ray.at(t);
     rec.set_face_normal(ray, normal);
     rec.material = material;
+    rec.deferred = false;
 
     return true;
   }
@@ -0,0 +1,223 @@
+#ifndef INTEGRATOR_HPP
+#define INTEGRATOR_HPP
+
+#include "rtweekend.hpp"
+
+#include "color.hpp"
+#include "hittable.hpp"
+#include "light_sampler.hpp"
+#include "material.hpp"
+#include "pdf.hpp"
+#include "render_stats.hpp"
+
+// How ray_color samples the lights at a diffuse bounce
+enum class LightSampling {
+  // Trace a single direction picked from a 50/50 mixture of the light and
+  // material PDFs
+  Mixture,
+  // Trace a shadow ray to a point on a light and a material sampled
+  // direction, weighting both by multiple importance sampling
+  Mis
+};
+
+// How ray_color traces paths
+struct PathSettings {
+  int max_depth;
+  // Bounces after which Russian roulette may end a path
+  int roulette_depth;
+  // Lower bound on the chance a path survives the roulette
+  double roulette_min_survival;
+  LightSampling light_sampling;
+  // Power heuristic if true, balance heuristic if false
+  bool power_heuristic;
+};
+
+// Fraction of a shadow ray's length left unchecked at the light end, so the
+// light itself never counts as an occluder
+const double shadow_epsilon = 1e-4;
+
+// Multiple importance sampling weight of a sample drawn with pdf_a, when
+// the same direction could also have been drawn with pdf_b
+inline double mis_weight(const PathSettings &settings, double pdf_a, double pdf_b)
+{
+  if(settings.power_heuristic) {
+    auto a2 = pdf_a * pdf_a;
+    return a2 / (a2 + pdf_b * pdf_b);
+  }
+  return pdf_a / (pdf_a + pdf_b);
+}
+
+// What a path carries from one bounce to the next
+struct PathState {
+  PathState(const Ray &r)
+    : ray(r), throughput(1, 1, 1), radiance(0, 0, 0), weigh_emission(false), scatter_pdf(0) {}
+
+  Ray ray;
+  Color throughput;
+  Color radiance;
+  // Set when ray was sampled from a material PDF at a point that also
+  // sampled the lights, so any light it hits must be MIS weighted
+  bool weigh_emission;
+  Point3 scatter_origin;
+  double scatter_pdf;
+};
+
+// A light sample waiting on its shadow ray. The contribution belongs in the
+// path's radiance unless something lies along ray before t_max.
+struct ShadowRay {
+  Ray ray;
+  double t_max;
+  Color contribution;
+};
+
+// Adds the light emitted at rec, the closest hit of path.ray, and scatters
+// the path onwards from it. Fills in shadow and sets has_shadow when the
+// lights were sampled. Returns false once the path has ended.
+bool shade_bounce(
+  PathState &path,
+  const HitRecord &rec,
+  int bounce,
+  const LightSampler &lights,
+  const PathSettings &settings,
+  ShadowRay &shadow,
+  bool &has_shadow
+)
+{
+  const bool has_lights = !lights.empty();
+  const bool use_mis = has_lights && settings.light_sampling == LightSampling::Mis;
+  const Ray &ray = path.ray;
+  has_shadow = false;
+
+  // Rays leaving the hit start just off the surface, on the side they head to
+  auto leaving = [&](const Vec3 &direction) {
+    return Ray(offset_ray_origin(rec.p, rec.normal, direction), direction, ray.time());
+  };
+
+  ScatterRecord srec;
+  Color emitted = material_emitted(rec.material, ray, rec, rec.u, rec.v, rec.p);
+  if(path.weigh_emission && !is_black(emitted)) {
+    auto light_pdf = lights.pdf_value(path.scatter_origin, ray.direction());
+    emitted = emitted * mis_weight(settings, path.scatter_pdf, light_pdf);
+  }
+  path.radiance += path.throughput * emitted;
+  path.weigh_emission = false;
+
+  if(!material_scatter(rec.material, ray, rec, srec))
+    return false;
+
+  if(srec.is_specular) {
+    path.throughput = path.throughput * srec.attenuation;
+    path.ray = leaving(srec.specular_ray.direction());
+  } else {
+    const Pdf *material_pdf = srec.get_pdf();
+    Ray scattered;
+    double pdf;
+    if(use_mis) {
+      // Next event estimation: find the point on the light the sampled
+      // direction reaches. The occlusion-only shadow ray up to it is left to
+      // the caller.
+      Ray to_light = leaving(lights.random(rec.p));
+      auto light_pdf = lights.pdf_value(rec.p, to_light.direction());
+      auto cosine_pdf = material_scattering_pdf(rec.material, ray, rec, to_light);
+      HitRecord light_rec;
+      if(light_pdf > 0 && cosine_pdf > 0 && lights.hit(to_light, 0.001, infinity, light_rec)) {
+        ++thread_counters().rays;
+        light_rec.resolve(to_light);
+        auto light_emitted = material_emitted(
+          light_rec.material, to_light, light_rec, light_rec.u, light_rec.v, light_rec.p
+        );
+        auto weight = mis_weight(settings, light_pdf, material_pdf->value(to_light.direction()));
+        shadow.ray = to_light;
+        shadow.t_max = light_rec.t * (1 - shadow_epsilon);
+        shadow.contribution = path.throughput * srec.attenuation * light_emitted * (cosine_pdf * weight / light_pdf);
+        has_shadow = true;
+      }
+
+      scattered = leaving(material_pdf->generate());
+      pdf = material_pdf->value(scattered.direction());
+
+      path.weigh_emission = true;
+      path.scatter_origin = rec.p;
+      path.scatter_pdf = pdf;
+    } else if(has_lights) {
+      HittablePdf light_pdf(&lights, rec.p);
+      MixturePdf mixed_pdf(&light_pdf, material_pdf);
+      scattered = leaving(mixed_pdf.generate());
+      pdf = mixed_pdf.value(scattered.direction());
+    } else {
+      scattered = leaving(material_pdf->generate());
+      pdf = material_pdf->value(scattered.direction());
+    }
+
+    path.throughput = path.throughput
+      * srec.attenuation
+      * material_scattering_pdf(rec.material, ray, rec, scattered) / pdf;
+    path.ray = scattered;
+  }
+
+  if(bounce >= settings.roulette_depth) {
+    // Russian roulette: continue with a probability that follows the
+    // throughput, and boost the survivors by the inverse of it so the
+    // estimate stays unbiased.
+    auto survival = fmax(path.throughput.x(), fmax(path.throughput.y(), path.throughput.z()));
+    survival = clamp(survival, settings.roulette_min_survival, 1.0);
+    if(random_double() >= survival) {
+      auto &counters = thread_counters();
+      counters.roulette_terminations++;
+      counters.roulette_bounces_saved += settings.max_depth - bounce - 1;
+      return false;
+    }
+    path.throughput /= survival;
+  }
+
+  return true;
+}
+
+// Follows a path whose first ray r has already been intersected with the
+// world: hit tells whether it hit anything and rec holds the hit if so.
+Color trace_path(
+  const Ray &r,
+  bool hit,
+  HitRecord &rec,
+  const Color &background,
+  const Hittable &world,
+  const LightSampler &lights,
+  const PathSettings &settings
+)
+{
+  // Follows the path iteratively, accumulating the light picked up at every
+  // bounce weighted by the throughput of the path so far.
+  PathState path(r);
+
+  for(int bounce = 0; bounce < settings.max_depth; bounce++) {
+    if(bounce > 0) {
+      ++thread_counters().rays;
+      hit = world.hit(path.ray, 0.001, infinity, rec);
+    }
+    if(!hit) {
+      path.radiance += path.throughput * background;
+      break;
+    }
+    rec.resolve(path.ray);
+
+    ShadowRay shadow;
+    bool has_shadow;
+    bool alive = shade_bounce(path, rec, bounce, lights, settings, shadow, has_shadow);
+    if(has_shadow && !world.occluded(shadow.ray, 0.001, shadow.t_max))
+      path.radiance += shadow.contribution;
+    if(!alive)
+      break;
+  }
+
+  return path.radiance;
+}
+
+Color ray_color(const Ray &r, const Color &background, const Hittable &world, const LightSampler &lights, const PathSettings &settings)
+{
+  HitRecord rec;
+  ++thread_counters().rays;
+  bool hit = world.hit(r, 0.001, infinity, rec);
+  return trace_path(r, hit, rec, background, world, lights, settings);
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef LIGHT_SAMPLER_HPP
+#define LIGHT_SAMPLER_HPP
+
+#include <vector>
+
+#include "rtweekend.hpp"
+
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "linear_bvh.hpp"
+
+// Picks lights in proportion to their emitted power from an alias table, in
+// constant time. The lights are kept in a LinearBvh so the PDF of a
+// direction only has to ask the lights the direction can actually reach.
+class LightSampler : public Hittable {
+public:
+  LightSampler(const HittableList &lights, double time0, double time1);
+
+  bool empty() const { return bvh.primitives.empty(); }
+
+  virtual bool hit(
+    const Ray &r, double t_min, double t_max, HitRecord &rec
+  ) const override {
+    return bvh.hit(r, t_min, t_max, rec);
+  }
+
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override {
+    return bvh.occluded(r, t_min, t_max);
+  }
+
+  virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override {
+    return bvh.bounding_box(time0, time1, output_box);
+  }
+
+  virtual double pdf_value(const Point3 &o, const Vec3 &v) const override;
+  virtual Vec3 random(const Vec3 &o) const override;
+
+public:
+  // One slot per light, in the order of bvh.primitives. Slot i yields
+  // light i with chance threshold and its alias otherwise.
+  struct AliasSlot {
+    double threshold;
+    uint32_t alias;
+    // Chance of picking light i overall
+    double probability;
+  };
+
+  LinearBvh bvh;
+  std::vector<AliasSlot> slots;
+};
+
+LightSampler::LightSampler(const HittableList &lights, double time0, double time1)
+  : bvh(lights, time0, time1)
+{
+  const auto count = bvh.primitives.size();
+  if(!count)
+    return;
+
+  std::vector<double> power(count);
+  double total = 0;
+  for(size_t i = 0; i < count; i++) {
+    power[i] = std::max(0.0, bvh.primitives[i]->emitted_power());
+    total += power[i];
+  }
+  // Fall back to picking uniformly if nothing claims to emit anything
+  if(total <= 0) {
+    std::fill(power.begin(), power.end(), 1.0);
+    total = count;
+  }
+
+  // Vose's alias method: pair every slot short of the mean with one over it
+  slots.resize(count);
+  std::vector<double> scaled(count);
+  std::vector<uint32_t> small, large;
+  for(size_t i = 0; i < count; i++) {
+    slots[i].probability = power[i] / total;
+    scaled[i] = slots[i].probability * count;
+    slots[i].alias = i;
+    (scaled[i] < 1 ? small : large).push_back(i);
+  }
+
+  while(!small.empty() && !large.empty()) {
+    auto s = small.back();
+    small.pop_back();
+    auto l = large.back();
+
+    slots[s].threshold = scaled[s];
+    slots[s].alias = l;
+    scaled[l] -= 1 - scaled[s];
+    if(scaled[l] < 1) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // Whatever is left is only off from one by rounding
+  for(auto i : small)
+    slots[i].threshold = 1;
+  for(auto i : large)
+    slots[i].threshold = 1;
+}
+
+double LightSampler::pdf_value(const Point3 &o, const Vec3 &v) const
+{
+  auto sum = 0.0;
+  bvh.visit_leaves(Ray(o, v), 0.001, infinity, [&](uint32_t i) {
+    if(slots[i].probability > 0)
+      sum += slots[i].probability * bvh.primitives[i]->pdf_value(o, v);
+  });
+  return sum;
+}
+
+Vec3 LightSampler::random(const Vec3 &o) const
+{
+  auto u = random_double() * slots.size();
+  auto i = std::min(static_cast<size_t>(u), slots.size() - 1);
+  if(u - i >= slots[i].threshold)
+    i = slots[i].alias;
+  return bvh.primitives[i]->random(o);
+}
+
+#endif
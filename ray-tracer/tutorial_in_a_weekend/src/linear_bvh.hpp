@@ -0,0 +1,543 @@
+#ifndef LINEAR_BVH_HPP
+#define LINEAR_BVH_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <tbb/parallel_for.h>
+#include <tbb/task_group.h>
+
+#include "rtweekend.hpp"
+
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "bvh.hpp"
+
+// One node of a LinearBvh, laid out so that two of them share a cache line.
+// The bounds are stored in single precision, rounded outwards so that the
+// box never shrinks. Interior nodes have their first child directly after
+// themselves in the node array.
+struct alignas(32) LinearBvhNode {
+  float bounds_min[3];
+  float bounds_max[3];
+  union {
+    uint32_t primitives_offset;   // Leaf
+    uint32_t second_child_offset; // Interior
+  };
+  uint16_t primitive_count;       // 0 for interior nodes
+  uint8_t axis;                   // Split axis of interior nodes
+  uint8_t pad;
+};
+
+static_assert(sizeof(LinearBvhNode) == 32, "LinearBvhNode should be 32 bytes");
+
+// A bounding volume hierarchy flattened into a contiguous array of nodes and
+// traversed iteratively, nearest child first, without any virtual calls
+// until a leaf is reached.
+class LinearBvh : public Hittable {
+public:
+  LinearBvh(const HittableList &list, double time0, double time1);
+  // Takes over a tree built earlier, such as one loaded from a scene file
+  LinearBvh(std::vector<LinearBvhNode> nodes, std::vector<Hittable*> primitives)
+    : nodes(std::move(nodes)), primitives(std::move(primitives)) {}
+
+  virtual bool hit(
+    const Ray &r, double t_min, double t_max, HitRecord &rec
+  ) const override;
+
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
+
+  virtual void hit_packet(
+    const RayPacket &packet, double t_min, double t_max, HitRecord recs[], bool hits[]
+  ) const override;
+
+  virtual bool bounding_box(
+    double time0, double time1, Aabb &output_box
+  ) const override;
+
+  // Calls visit(index) for every primitive in a leaf the ray passes
+  // through within [t_min, t_max], in no particular order
+  template<typename Visit>
+  void visit_leaves(const Ray &r, double t_min, double t_max, Visit visit) const;
+
+public:
+  // Maximum number of objects in a leaf
+  static const int max_leaf_size = 4;
+  // Deepest tree the traversal stacks have room for, counting the root and
+  // the leaves
+  static const int max_depth = 64;
+
+  std::vector<LinearBvhNode> nodes;
+  std::vector<Hittable*> primitives;
+
+private:
+  struct BuildItem {
+    Aabb box;
+    Hittable *object;
+  };
+
+  struct BuildNode {
+    Aabb box;
+    std::unique_ptr<BuildNode> children[2];
+    int axis = 0;
+    size_t first = 0;
+    size_t count = 0;
+  };
+
+  static std::unique_ptr<BuildNode> build(
+    std::vector<BuildItem> &items, size_t start, size_t end, int depth, std::atomic<size_t> &node_count
+  );
+  uint32_t flatten(const BuildNode *node);
+  static bool node_hit(
+    const LinearBvhNode &node, const float origin[3], const float inv_dir[3], float t_min, float t_max
+  );
+};
+
+inline float round_down(double x)
+{
+  auto f = static_cast<float>(x);
+  return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up(double x)
+{
+  auto f = static_cast<float>(x);
+  return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// The rays of a packet in single precision for box tests, plus bounds on
+// their origins and inverse directions. Traversals keep the index of the
+// first ray still known to reach a node; when coherent rays hit the same
+// boxes that first ray is usually the only one tested. Boxes that no ray in
+// the packet can reach are culled with interval arithmetic over the bounds.
+struct PacketTraversal {
+  PacketTraversal(const RayPacket &packet, double t_min, double t_max)
+    : size(packet.size), t_lower(round_down(t_min)), coherent(true)
+  {
+    for(int a = 0; a < 3; a++) {
+      origin_lo[a] = inv_dir_lo[a] = std::numeric_limits<float>::infinity();
+      origin_hi[a] = inv_dir_hi[a] = -std::numeric_limits<float>::infinity();
+      for(int k = 0; k < size; k++) {
+        origin[a][k] = static_cast<float>(packet.rays[k].origin()[a]);
+        inv_dir[a][k] = static_cast<float>(packet.rays[k].inv_dir[a]);
+        origin_lo[a] = std::min(origin_lo[a], origin[a][k]);
+        origin_hi[a] = std::max(origin_hi[a], origin[a][k]);
+        inv_dir_lo[a] = std::min(inv_dir_lo[a], inv_dir[a][k]);
+        inv_dir_hi[a] = std::max(inv_dir_hi[a], inv_dir[a][k]);
+      }
+      // The interval test needs every direction on the same side of each
+      // axis, or the inverse directions span infinity.
+      if(!(inv_dir_lo[a] > 0 || inv_dir_hi[a] < 0))
+        coherent = false;
+      if(!std::isfinite(inv_dir_lo[a]) || !std::isfinite(inv_dir_hi[a]))
+        coherent = false;
+    }
+    for(int k = 0; k < size; k++)
+      t_upper[k] = round_up(t_max) * 1.0000008f;
+    packet_t_upper = size ? t_upper[0] : t_lower;
+  }
+
+  // Whether any ray in the packet might reach the box
+  bool may_hit(const float bounds_min[3], const float bounds_max[3]) const
+  {
+    if(!coherent)
+      return true;
+    float t0 = t_lower;
+    float t1 = packet_t_upper;
+    for(int a = 0; a < 3; a++) {
+      const bool neg = inv_dir_lo[a] < 0;
+      const float near_plane = neg ? bounds_max[a] : bounds_min[a];
+      const float far_plane = neg ? bounds_min[a] : bounds_max[a];
+      // Bounds on (plane - origin) * inv_dir over every ray in the packet
+      float near_d[2] = {near_plane - origin_hi[a], near_plane - origin_lo[a]};
+      float far_d[2] = {far_plane - origin_hi[a], far_plane - origin_lo[a]};
+      float near_lo = std::numeric_limits<float>::infinity();
+      float far_hi = -std::numeric_limits<float>::infinity();
+      for(int i = 0; i < 2; i++) {
+        for(auto inv : {inv_dir_lo[a], inv_dir_hi[a]}) {
+          near_lo = std::min(near_lo, near_d[i] * inv);
+          far_hi = std::max(far_hi, far_d[i] * inv);
+        }
+      }
+      t0 = near_lo > t0 ? near_lo : t0;
+      t1 = far_hi < t1 ? far_hi : t1;
+    }
+    return t0 <= t1;
+  }
+
+  // Same test as LinearBvh::node_hit for ray k
+  bool ray_hits(int k, const float bounds_min[3], const float bounds_max[3]) const
+  {
+    float t0 = t_lower;
+    float t1 = t_upper[k];
+    for(int a = 0; a < 3; a++) {
+      auto near_t = (bounds_min[a] - origin[a][k]) * inv_dir[a][k];
+      auto far_t = (bounds_max[a] - origin[a][k]) * inv_dir[a][k];
+      if(inv_dir[a][k] < 0.0f)
+        std::swap(near_t, far_t);
+      t0 = near_t > t0 ? near_t : t0;
+      t1 = far_t < t1 ? far_t : t1;
+    }
+    return t0 <= t1;
+  }
+
+  // Index of the first ray from first on that reaches the box, or size
+  int first_hit(int first, const float bounds_min[3], const float bounds_max[3]) const
+  {
+    if(!may_hit(bounds_min, bounds_max))
+      return size;
+    while(first < size && !ray_hits(first, bounds_min, bounds_max))
+      first++;
+    return first;
+  }
+
+  // Ray k has found a hit at t, nothing further along it matters any more
+  void shorten(int k, double t)
+  {
+    t_upper[k] = round_up(t) * 1.0000008f;
+    packet_t_upper = t_upper[0];
+    for(int i = 1; i < size; i++)
+      packet_t_upper = std::max(packet_t_upper, t_upper[i]);
+  }
+
+  int size;
+  float origin[3][max_packet_size];
+  float inv_dir[3][max_packet_size];
+  float t_lower;
+  float t_upper[max_packet_size];
+  float packet_t_upper;
+  float origin_lo[3], origin_hi[3];
+  float inv_dir_lo[3], inv_dir_hi[3];
+  bool coherent;
+};
+
+LinearBvh::LinearBvh(const HittableList &list, double time0, double time1)
+{
+  std::vector<BuildItem> items(list.objects.size());
+  if(items.empty())
+    return;
+
+  tbb::parallel_for(size_t(0), items.size(), [&](size_t i) {
+    auto &item = items[i];
+    item.object = list.objects[i];
+    if(!item.object->bounding_box(time0, time1, item.box))
+      std::cerr << "No bounding box in LinearBvh constructor.\n";
+  });
+
+  std::atomic<size_t> node_count(0);
+  auto root = build(items, 0, items.size(), 1, node_count);
+
+  // Leaves refer to ranges of the items, which are in their final order now
+  primitives.resize(items.size());
+  for(size_t i = 0; i < items.size(); i++)
+    primitives[i] = items[i].object;
+
+  nodes.reserve(node_count);
+  flatten(root.get());
+}
+
+std::unique_ptr<LinearBvh::BuildNode> LinearBvh::build(
+  std::vector<BuildItem> &items, size_t start, size_t end, int depth, std::atomic<size_t> &node_count
+)
+{
+  auto node = std::make_unique<BuildNode>();
+  node_count++;
+
+  node->box = items[start].box;
+  for(size_t i = start + 1; i < end; i++)
+    node->box = surrounding_box(node->box, items[i].box);
+
+  size_t count = end - start;
+  if(count > 1) {
+    // Splitting in halves all the way down takes this many more levels.
+    // SAH splits can be as lopsided as peeling off one item at a time, so
+    // they are only made while halving would still fit below them in
+    // max_depth.
+    int halvings = 0;
+    while((size_t(1) << halvings) < count)
+      halvings++;
+    auto box_of = [](const BuildItem &item) { return item.box; };
+    auto split = depth + 1 + halvings <= max_depth
+      ? sah_partition(items, start, end, box_of)
+      : median_partition(items, start, end, box_of);
+
+    // Splitting is only worth it when it is expected to be cheaper than
+    // intersecting every object in the node.
+    if(count > max_leaf_size || split.cost < count) {
+      node->axis = split.axis;
+      if(count > bvh_parallel_threshold) {
+        tbb::task_group tasks;
+        tasks.run([&] { node->children[0] = build(items, start, split.mid, depth + 1, node_count); });
+        node->children[1] = build(items, split.mid, end, depth + 1, node_count);
+        tasks.wait();
+      } else {
+        node->children[0] = build(items, start, split.mid, depth + 1, node_count);
+        node->children[1] = build(items, split.mid, end, depth + 1, node_count);
+      }
+      return node;
+    }
+  }
+
+  node->first = start;
+  node->count = count;
+
+  return node;
+}
+
+uint32_t LinearBvh::flatten(const BuildNode *node)
+{
+  auto offset = static_cast<uint32_t>(nodes.size());
+  nodes.emplace_back();
+
+  LinearBvhNode linear;
+  for(int a = 0; a < 3; a++) {
+    linear.bounds_min[a] = round_down(node->box.min()[a]);
+    linear.bounds_max[a] = round_up(node->box.max()[a]);
+  }
+  linear.axis = static_cast<uint8_t>(node->axis);
+  linear.pad = 0;
+
+  if(node->count > 0) {
+    linear.primitives_offset = static_cast<uint32_t>(node->first);
+    linear.primitive_count = static_cast<uint16_t>(node->count);
+  } else {
+    linear.primitive_count = 0;
+    flatten(node->children[0].get());
+    linear.second_child_offset = flatten(node->children[1].get());
+  }
+
+  nodes[offset] = linear;
+  return offset;
+}
+
+bool LinearBvh::bounding_box(double time0, double time1, Aabb &output_box) const
+{
+  if(nodes.empty())
+    return false;
+
+  const auto &root = nodes[0];
+  output_box = Aabb(
+    Point3(root.bounds_min[0], root.bounds_min[1], root.bounds_min[2]),
+    Point3(root.bounds_max[0], root.bounds_max[1], root.bounds_max[2])
+  );
+  return true;
+}
+
+inline bool LinearBvh::node_hit(
+  const LinearBvhNode &node, const float origin[3], const float inv_dir[3], float t_min, float t_max
+)
+{
+  for(int a = 0; a < 3; a++) {
+    auto t0 = (node.bounds_min[a] - origin[a]) * inv_dir[a];
+    auto t1 = (node.bounds_max[a] - origin[a]) * inv_dir[a];
+    if(inv_dir[a] < 0.0f)
+      std::swap(t0, t1);
+    t_min = t0 > t_min ? t0 : t_min;
+    t_max = t1 < t_max ? t1 : t_max;
+  }
+  return t_min <= t_max;
+}
+
+bool LinearBvh::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const
+{
+  if(nodes.empty())
+    return false;
+
+  float origin[3], inv_dir[3];
+  bool dir_is_neg[3];
+  for(int a = 0; a < 3; a++) {
+    origin[a] = static_cast<float>(r.origin()[a]);
+    inv_dir[a] = static_cast<float>(r.inv_dir[a]);
+    dir_is_neg[a] = r.sign[a];
+  }
+
+  // Widen the float interval slightly so rounding can't cull a box the ray
+  // actually grazes.
+  const float t_lower = round_down(t_min);
+  float t_upper = round_up(t_max) * 1.0000008f;
+
+  uint32_t stack[max_depth];
+  int stack_size = 0;
+  uint32_t current = 0;
+  bool hit_anything = false;
+
+  while(true) {
+    const auto &node = nodes[current];
+    if(node_hit(node, origin, inv_dir, t_lower, t_upper)) {
+      if(node.primitive_count > 0) {
+        for(uint32_t i = 0; i < node.primitive_count; i++) {
+          if(primitives[node.primitives_offset + i]->hit(r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+            t_upper = round_up(t_max) * 1.0000008f;
+          }
+        }
+        if(!stack_size)
+          break;
+        current = stack[--stack_size];
+      } else if(dir_is_neg[node.axis]) {
+        // Visit the second child first, it's the one nearer the ray origin
+        stack[stack_size++] = current + 1;
+        current = node.second_child_offset;
+      } else {
+        stack[stack_size++] = node.second_child_offset;
+        current = current + 1;
+      }
+    } else {
+      if(!stack_size)
+        break;
+      current = stack[--stack_size];
+    }
+  }
+
+  return hit_anything;
+}
+
+bool LinearBvh::occluded(const Ray &r, double t_min, double t_max) const
+{
+  if(nodes.empty())
+    return false;
+
+  float origin[3], inv_dir[3];
+  bool dir_is_neg[3];
+  for(int a = 0; a < 3; a++) {
+    origin[a] = static_cast<float>(r.origin()[a]);
+    inv_dir[a] = static_cast<float>(r.inv_dir[a]);
+    dir_is_neg[a] = r.sign[a];
+  }
+
+  const float t_lower = round_down(t_min);
+  const float t_upper = round_up(t_max) * 1.0000008f;
+
+  // Same walk as hit, but any intersection ends it and the interval never
+  // shrinks.
+  uint32_t stack[max_depth];
+  int stack_size = 0;
+  uint32_t current = 0;
+
+  while(true) {
+    const auto &node = nodes[current];
+    if(node_hit(node, origin, inv_dir, t_lower, t_upper)) {
+      if(node.primitive_count > 0) {
+        for(uint32_t i = 0; i < node.primitive_count; i++) {
+          if(primitives[node.primitives_offset + i]->occluded(r, t_min, t_max))
+            return true;
+        }
+        if(!stack_size)
+          break;
+        current = stack[--stack_size];
+      } else if(dir_is_neg[node.axis]) {
+        stack[stack_size++] = current + 1;
+        current = node.second_child_offset;
+      } else {
+        stack[stack_size++] = node.second_child_offset;
+        current = current + 1;
+      }
+    } else {
+      if(!stack_size)
+        break;
+      current = stack[--stack_size];
+    }
+  }
+
+  return false;
+}
+
+void LinearBvh::hit_packet(
+  const RayPacket &packet, double t_min, double t_max, HitRecord recs[], bool hits[]
+) const
+{
+  for(int k = 0; k < packet.size; k++)
+    hits[k] = false;
+  if(nodes.empty())
+    return;
+
+  PacketTraversal traversal(packet, t_min, t_max);
+  double t_closest[max_packet_size];
+  for(int k = 0; k < packet.size; k++)
+    t_closest[k] = t_max;
+
+  // Each entry also carries the first ray that reached its parent, none of
+  // the rays before it can reach the node either
+  struct StackEntry {
+    uint32_t node;
+    int first;
+  };
+  StackEntry stack[max_depth];
+  int stack_size = 0;
+  StackEntry current = {0, 0};
+
+  while(true) {
+    const auto &node = nodes[current.node];
+    int first = traversal.first_hit(current.first, node.bounds_min, node.bounds_max);
+    if(first < packet.size) {
+      if(node.primitive_count > 0) {
+        for(int k = first; k < packet.size; k++) {
+          if(k != first && !traversal.ray_hits(k, node.bounds_min, node.bounds_max))
+            continue;
+          for(uint32_t i = 0; i < node.primitive_count; i++) {
+            if(primitives[node.primitives_offset + i]->hit(packet.rays[k], t_min, t_closest[k], recs[k])) {
+              hits[k] = true;
+              t_closest[k] = recs[k].t;
+              traversal.shorten(k, t_closest[k]);
+            }
+          }
+        }
+        if(!stack_size)
+          break;
+        current = stack[--stack_size];
+      } else if(traversal.inv_dir[node.axis][first] < 0) {
+        // Near to far in the order of the first ray that got here
+        stack[stack_size++] = {current.node + 1, first};
+        current = {node.second_child_offset, first};
+      } else {
+        stack[stack_size++] = {node.second_child_offset, first};
+        current = {current.node + 1, first};
+      }
+    } else {
+      if(!stack_size)
+        break;
+      current = stack[--stack_size];
+    }
+  }
+}
+
+template<typename Visit>
+void LinearBvh::visit_leaves(const Ray &r, double t_min, double t_max, Visit visit) const
+{
+  if(nodes.empty())
+    return;
+
+  float origin[3], inv_dir[3];
+  for(int a = 0; a < 3; a++) {
+    origin[a] = static_cast<float>(r.origin()[a]);
+    inv_dir[a] = static_cast<float>(r.inv_dir[a]);
+  }
+
+  const float t_lower = round_down(t_min);
+  const float t_upper = round_up(t_max) * 1.0000008f;
+
+  uint32_t stack[max_depth];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+
+  while(stack_size) {
+    auto current = stack[--stack_size];
+    const auto &node = nodes[current];
+    if(!node_hit(node, origin, inv_dir, t_lower, t_upper))
+      continue;
+
+    if(node.primitive_count > 0) {
+      for(uint32_t i = 0; i < node.primitive_count; i++)
+        visit(node.primitives_offset + i);
+    } else {
+      stack[stack_size++] = node.second_child_offset;
+      stack[stack_size++] = current + 1;
+    }
+  }
+}
+
+#endif
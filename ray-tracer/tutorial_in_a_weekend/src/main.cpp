@@ -9,7 +9,8 @@
 #include <random>
 #include <iostream>
 #include <fstream>
-#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include <nlohmann/json.hpp>
 
@@ -20,6 +21,15 @@
 #include "color.hpp"
 #include "hittable_list.hpp"
 #include "bvh.hpp"
+#include "linear_bvh.hpp"
+#include "wide_bvh.hpp"
+#include "light_sampler.hpp"
+#include "integrator.hpp"
+#include "wavefront.hpp"
+#include "sphere_set.hpp"
+#include "arena.hpp"
+#include "world.hpp"
+#include "scene_file.hpp"
 #include "box.hpp"
 #include "sphere.hpp"
 #include "moving_sphere.hpp"
@@ -28,6 +38,9 @@
 #include "material.hpp"
 #include "constant_medium.hpp"
 #include "pdf.hpp"
+#include "png_writer.hpp"
+#include "render_stats.hpp"
+#include "tile_scheduler.hpp"
 
 #define SAMPLE_CLAMP 100
 #undef SAMPLE_CLAMP
@@ -37,92 +50,6 @@
 using json = nlohmann::json;
 
 
-void save_png(std::vector<double> &data, const int width, const int height, const char *filename)
-{
-  int y, x;
-  uint8_t *pixels;
-  const int64_t pitch = width * 3;
-  pixels = new uint8_t[data.size()];
-
-  // Change from RGB to BGR because PNG sucks.
-  for(y=0; y<height; y++) {
-    for(x=0; x < pitch - 3; x += 3) {
-      auto r = data[(int64_t)y * pitch + x + 0LL];
-      auto g = data[(int64_t)y * pitch + x + 1LL];
-      auto b = data[(int64_t)y * pitch + x + 2LL];
-
-      pixels[(int64_t)y * pitch + x + 0LL] = static_cast<int>(256 * clamp(sqrt(r), 0.0, 0.999));
-      pixels[(int64_t)y * pitch + x + 1LL] = static_cast<int>(256 * clamp(sqrt(g), 0.0, 0.999));
-      pixels[(int64_t)y * pitch + x + 2LL] = static_cast<int>(256 * clamp(sqrt(b), 0.0, 0.999));
-    }
-  }
-
-  stbi_write_png( filename, width, height, STBI_rgb, pixels, (int)pitch );
-  delete[] pixels;
-}
-
-
-Color ray_color(const Ray &r, const Color &background, const Hittable &world, Hittable &lights, int depth)
-{
-  HitRecord rec;
-
-  if(depth <= 0)
-    return Color(0, 0, 0);
-
-  if(!world.hit(r, 0.001, infinity, rec))
-    return background;
-
-  ScatterRecord srec;
-  //std::cerr << "ray_color before rec.material->emitted()" << std::endl;
-  Color emitted = rec.material->emitted(r, rec, rec.u, rec.v, rec.p);
-
-  //std::cerr << "ray_color before !rec.material->scatter()" << std::endl;
-  if(!rec.material->scatter(r, rec, srec))
-    return emitted;
-
-  if(srec.is_specular) {
-    //std::cerr << "ray_color before srec.attenuation * ray_color()" << std::endl;
-    return srec.attenuation
-      * ray_color(srec.specular_ray, background, world, lights, depth-1);
-  }
-
-  Vec3 scatter_direction;
-  Ray scattered;
-  double pdf;
-  if(dynamic_cast<HittableList*>(&lights)->size()) {
-    //std::cerr << "ray_color before MixturePdf" << std::endl;
-    auto p0 = std::make_shared<HittablePdf>(&lights, rec.p);
-    MixturePdf mixed_pdf = MixturePdf(p0, srec.pdf);
-    //std::cerr << "ray_color before mixed_pdf.generate()" << std::endl;
-    scatter_direction = mixed_pdf.generate();
-    scattered = Ray(rec.p, scatter_direction, r.time());
-    //std::cerr << "ray_color before mixed_pdf.value()" << std::endl;
-    pdf = mixed_pdf.value(scattered.direction());
-  } else {
-    //std::cerr << "ray_color before srec.pdf->generat()" << std::endl;
-    scatter_direction = srec.pdf->generate();
-    scattered = Ray(rec.p, scatter_direction, r.time());
-    //std::cerr << "ray_color before srec.pdf->value()" << std::endl;
-    pdf = srec.pdf->value(scattered.direction());
-  }
-
-  //std::cerr << "ray_color return" << std::endl;
-  return emitted
-    + srec.attenuation
-    * rec.material->scattering_pdf(r, rec, scattered) / pdf
-    * ray_color(scattered, background, world, lights, depth-1);
-}
-
-typedef struct {
-  Color background;
-  std::map<std::string, Texture*> texture_list;
-  std::map<std::string, Material*> material_list;
-  std::map<std::string, Hittable*> object_list;
-  HittableList objects;
-  HittableList lights;
-} World;
-
-
 World build_world(json &conf)
 {
   World world;
@@ -153,7 +80,7 @@ World build_world(json &conf)
         auto col1 = tx["color1"].get<std::string>();
         auto col2 = tx["color2"].get<std::string>();
 
-        new_texture = new CheckerTexture(
+        new_texture = world.arena.create<CheckerTexture>(
           world.texture_list[col1], world.texture_list[col2]
         );
       } else if( texture_type == "SolidColor" ) {
@@ -161,14 +88,14 @@ World build_world(json &conf)
         auto green = tx["green"].get<double>();
         auto blue = tx["blue"].get<double>();
 
-        new_texture = new SolidColor(Color(red, green, blue));
+        new_texture = world.arena.create<SolidColor>(Color(red, green, blue));
       } else {
         throw("Unknown texture type: '" + texture_type + "'");
       }
 
       world.texture_list[key] = new_texture;
 
-      world.texture_list[key]->setName(key);
+      world.names[world.texture_list[key]] = key;
       // std::cerr << "  " + key << std::endl;
     } catch(nlohmann::detail::type_error &e) {
       std::cerr << "Texture failed" << std::endl;
@@ -192,11 +119,11 @@ World build_world(json &conf)
       if( material_type == "Lambertian" ) {
         auto tex = mtl["texture"].get<std::string>();
 
-        world.material_list[key] = new Lambertian(world.texture_list[tex]);
+        world.material_list[key] = world.arena.create<Lambertian>(world.texture_list[tex]);
       } else if( material_type == "DiffuseLight" ) {
         auto tex = mtl["texture"].get<std::string>();
 
-        world.material_list[key] = new DiffuseLight(world.texture_list[tex]);
+        world.material_list[key] = world.arena.create<DiffuseLight>(world.texture_list[tex]);
       } else if( material_type == "Metal" ) {
         auto red = mtl["red"].get<double>();
         auto green = mtl["green"].get<double>();
@@ -204,16 +131,16 @@ World build_world(json &conf)
 
         auto fuzz = mtl["fuzz"].get<double>();
 
-        world.material_list[key] = new Metal(Color(red, green, blue), fuzz);
+        world.material_list[key] = world.arena.create<Metal>(Color(red, green, blue), fuzz);
       } else if( material_type == "Dielectric" ) {
         auto refraction = mtl["refraction"].get<double>();
 
-        world.material_list[key] = new Dielectric(refraction);
+        world.material_list[key] = world.arena.create<Dielectric>(refraction);
       } else {
         throw("Unknown material type: '" + material_type + "'");
       }
 
-      world.material_list[key]->setName(key);
+      world.names[world.material_list[key]] = key;
       // std::cerr << "  " + key << std::endl;
     } catch(nlohmann::detail::type_error &e) {
       std::cerr << "Material failed" << std::endl;
@@ -242,7 +169,7 @@ World build_world(json &conf)
         auto center = Point3(x, y, z);
         auto radius = obj["radius"].get<double>();
         auto material = world.material_list[obj["material"].get<std::string>()];
-        world.object_list[key] = new Sphere(
+        world.object_list[key] = world.arena.create<Sphere>(
           center, radius, material
         );
       } else if( object_type == "MovingSphere" ) {
@@ -264,14 +191,14 @@ World build_world(json &conf)
         auto time1 = obj["time1"].get<double>();
 
         auto material = world.material_list[obj["material"].get<std::string>()];
-        world.object_list[key] = new MovingSphere(
+        world.object_list[key] = world.arena.create<MovingSphere>(
           center0, center1, time0, time1, radius, material
         );
       } else {
         throw("Unknown object type: '" + object_type + "'");
       }
 
-      world.object_list[key]->setName(key);
+      world.names[world.object_list[key]] = key;
       world.objects.add(world.object_list[key]);
       // std::cerr << "  " + key << std::endl;
     } catch(nlohmann::detail::type_error &e) {
@@ -301,7 +228,19 @@ World build_world(json &conf)
 int main(int argc, char *argv[])
 {
   char *filename;
-  if(argc >= 2) {
+  // raytracer --convert world.json world.bin writes the world as a binary
+  // scene file, with a BVH built for the shutter interval in camera.json
+  // and the sphere_sets setting in render.json
+  std::string convert_from, convert_to;
+  if(argc >= 2 && std::string(argv[1]) == "--convert") {
+    if(argc != 4) {
+      std::cerr << "Usage: " << argv[0] << " --convert world.json world.bin" << std::endl;
+      return -1;
+    }
+    convert_from = argv[2];
+    convert_to = argv[3];
+    filename = const_cast<char*>("test.png");
+  } else if(argc >= 2) {
     filename = argv[1];
   } else {
     filename = const_cast<char*>("test.png");
@@ -312,8 +251,20 @@ int main(int argc, char *argv[])
   int height;
   int min_samples_per_pixel;
   int max_samples_per_pixel;
-  int max_depth;
+  PathSettings path_settings;
   double pincer_limit;
+  std::string accelerator;
+  bool sphere_sets;
+  std::string world_path;
+  bool deterministic;
+  uint64_t seed;
+  Sampler::Type sampler_type;
+  int tile_size;
+  TileScheduler::Order tile_order;
+  int threads;
+  bool wavefront;
+  size_t wavefront_size;
+  int packet_size;
   Color background(0, 0, 0);
 
   // Camera settings
@@ -358,9 +309,73 @@ int main(int argc, char *argv[])
     height = render_conf["height"].get<int>();
     min_samples_per_pixel = render_conf["min_samples_per_pixel"].get<int>();
     max_samples_per_pixel = render_conf["max_samples_per_pixel"].get<int>();
-    max_depth = render_conf["max_depth"].get<int>();
+    path_settings.max_depth = render_conf["max_depth"].get<int>();
+    path_settings.roulette_depth = render_conf.value("roulette_depth", 5);
+    path_settings.roulette_min_survival = render_conf.value("roulette_min_survival", 0.05);
+
+    auto light_sampling = render_conf.value("light_sampling", "mis");
+    if(light_sampling == "mis") {
+      path_settings.light_sampling = LightSampling::Mis;
+    } else if(light_sampling == "mixture") {
+      path_settings.light_sampling = LightSampling::Mixture;
+    } else {
+      std::cerr << "Unknown light sampling: '" << light_sampling << "'" << std::endl;
+      return -1;
+    }
+
+    auto heuristic = render_conf.value("mis_heuristic", "power");
+    if(heuristic != "power" && heuristic != "balance") {
+      std::cerr << "Unknown MIS heuristic: '" << heuristic << "'" << std::endl;
+      return -1;
+    }
+    path_settings.power_heuristic = heuristic == "power";
     pincer_limit = render_conf["pincer_limit"].get<double>();
+    accelerator = render_conf.value("accelerator", "bvh4");
+    sphere_sets = render_conf.value("sphere_sets", true);
+    // A .bin file is a binary scene file, anything else a world.json
+    world_path = render_conf.value("world", "../world.json");
+    deterministic = render_conf.value("deterministic", false);
+    seed = render_conf.value("seed", 0);
+
+    auto sampler_name = render_conf.value("sampler", "sobol");
+    if(!Sampler::parse_type(sampler_name, sampler_type)) {
+      std::cerr << "Unknown sampler: '" << sampler_name << "'" << std::endl;
+      return -1;
+    }
 
+    tile_size = render_conf.value("tile_size", 16);
+    if(tile_size < 1) {
+      std::cerr << "tile_size must be at least 1" << std::endl;
+      return -1;
+    }
+    auto tile_order_name = render_conf.value("tile_order", "hilbert");
+    if(!TileScheduler::parse_order(tile_order_name, tile_order)) {
+      std::cerr << "Unknown tile order: '" << tile_order_name << "'" << std::endl;
+      return -1;
+    }
+
+    // 0 means one thread per core
+    threads = render_conf.value("threads", 0);
+    if(threads <= 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // megakernel traces one sample at a time with ray_color, wavefront
+    // traces a tile's samples together in batches of up to wavefront_size
+    auto mode = render_conf.value("mode", "megakernel");
+    if(mode != "megakernel" && mode != "wavefront") {
+      std::cerr << "Unknown render mode: '" << mode << "'" << std::endl;
+      return -1;
+    }
+    wavefront = mode == "wavefront";
+    wavefront_size = std::max(2, render_conf.value("wavefront_size", 65536));
+
+    // Camera rays traced together while taking the minimum samples with a
+    // pinhole camera, 0 or 1 to trace them one at a time
+    packet_size = render_conf.value("packet_size", 16);
+    if(packet_size < 0 || packet_size > max_packet_size) {
+      std::cerr << "packet_size must be between 0 and " << max_packet_size << std::endl;
+      return -1;
+    }
 
   } catch(nlohmann::detail::parse_error &e) {
     std::cout << "No render file found (" << e.what() << ")" << std::endl;
@@ -368,160 +383,397 @@ int main(int argc, char *argv[])
   }
 
   aspect_ratio = (double)width / height;
-  try {
-    std::ifstream world_file("../world.json", std::ifstream::in);
-    json world_conf;
-    world_file >> world_conf;
-    world = build_world(world_conf);
-  } catch(nlohmann::detail::parse_error &e) {
-    std::cerr << "No world file found (" << e.what() << ")" << std::endl;
-    return -1;
+  if(!convert_from.empty())
+    world_path = convert_from;
+  if(has_extension(world_path, ".bin")) {
+    std::cerr << "Reading scene file '" << world_path << "'" << std::endl;
+    if(!read_scene(world_path, world))
+      return -1;
+  } else {
+    try {
+      std::ifstream world_file(world_path, std::ifstream::in);
+      json world_conf;
+      world_file >> world_conf;
+      world = build_world(world_conf);
+    } catch(nlohmann::detail::parse_error &e) {
+      std::cerr << "No world file found (" << e.what() << ")" << std::endl;
+      return -1;
+    }
   }
 
   objects = world.objects;
   lights = world.lights;
   background = world.background;
 
+  // A scene file's BVH can be used as long as the scene is set up the same
+  // way it was when the file was written
+  bool prebuilt = world.bvh
+    && world.grouped_spheres == sphere_sets
+    && world.bvh_time0 == time0
+    && world.bvh_time1 == time1;
+  if(world.bvh && !prebuilt)
+    std::cerr << "The scene file's BVH was built for other settings, building a new one" << std::endl;
+
+  // Spheres close together are intersected a SIMD register at a time
+  if(prebuilt) {
+    objects = world.bvh_objects;
+  } else if(sphere_sets) {
+    objects = group_spheres(objects, lights, time0, time1, world.arena);
+    std::cerr << "Grouped spheres into " << objects.size() << " objects" << std::endl;
+  }
+
+  if(!convert_to.empty()) {
+    if(!prebuilt) {
+      std::cerr << "Building linear BVH over " << objects.size() << " objects" << std::endl;
+      world.bvh = world.arena.create<LinearBvh>(objects, time0, time1);
+    }
+    std::cerr << "Writing scene file '" << convert_to << "'" << std::endl;
+    if(!write_scene(world, objects, sphere_sets, *world.bvh, time0, time1, convert_to))
+      return -1;
+    return 0;
+  }
+
+  // Acceleration structure
+  Hittable *scene = &objects;
+  if(accelerator == "bvh") {
+    if(objects.size()) {
+      std::cerr << "Building BVH over " << objects.size() << " objects" << std::endl;
+      scene = world.arena.create<BvhNode>(objects, time0, time1);
+    }
+  } else if(accelerator == "linear_bvh") {
+    LinearBvh *bvh;
+    if(prebuilt) {
+      std::cerr << "Using the scene file's linear BVH over " << objects.size() << " objects" << std::endl;
+      bvh = world.bvh;
+    } else {
+      std::cerr << "Building linear BVH over " << objects.size() << " objects" << std::endl;
+      bvh = world.arena.create<LinearBvh>(objects, time0, time1);
+    }
+    std::cerr << "  " << bvh->nodes.size() << " nodes" << std::endl;
+    scene = bvh;
+  } else if(accelerator == "bvh4") {
+    WideBvh *bvh;
+    if(prebuilt) {
+      std::cerr << "Collapsing the scene file's BVH over " << objects.size() << " objects" << std::endl;
+      bvh = world.arena.create<WideBvh>(*world.bvh, time0, time1);
+    } else {
+      std::cerr << "Building 4-wide BVH over " << objects.size() << " objects" << std::endl;
+      bvh = world.arena.create<WideBvh>(objects, time0, time1);
+    }
+    std::cerr << "  " << bvh->nodes.size() << " nodes" << std::endl;
+    scene = bvh;
+  } else if(accelerator != "list") {
+    std::cerr << "Unknown accelerator: '" << accelerator << "'" << std::endl;
+    return -1;
+  }
+
+  std::cerr << "Building light sampler over " << lights.size() << " lights" << std::endl;
+  LightSampler light_sampler(lights, time0, time1);
+
   // Camera
   Camera cam(look_from, look_at, vup, vfov, aspect_ratio, aperture, dist_to_focus, time0, time1);
 
   // Image data
   std::vector<double> data(3LL * height * width);
-  std::vector<int> scanlines;
-  for(int i = 0; i < height; ++i) {
-    scanlines.push_back(i);
-  }
+  TileScheduler tiles(width, height, tile_size, tile_order);
 
   // Render
-  std::cerr << "Begin" << std::endl;
-  int64_t line_count = 0;
-  int64_t sample_count = 0;
-  int64_t samples_reached_max = 0;
-  int64_t next_save = height / 10;
-  std::mutex mutex;
-  for_each(
-    std::execution::par_unseq,
-    scanlines.begin(),
-    scanlines.end(),
-    [
-      &width,
-      &height,
-      &data,
-      &cam,
-      &objects,
-      &lights,
-      &max_depth,
-      &pincer_limit,
-      &min_samples_per_pixel,
-      &max_samples_per_pixel,
-      &line_count,
-      &sample_count,
-      &next_save,
-      &mutex,
-      &background,
-      &samples_reached_max,
-      &filename
-    ] (auto &&j) {
-      int64_t line_sample_count = 0;
-      int64_t local_reached_max = 0;
-      for (int i = 0; i < width; ++i) {
-        // Pre-emptively increase max counter
-        local_reached_max++;
-        Color c1(0, 0, 0), c2(0, 0, 0);
-        int64_t count = 0;
-        for(int s = 0; s < min_samples_per_pixel / 2; s++) {
-          auto u = (i + random_double()) / ((double)width - 1);
-          auto v = (j + random_double()) / ((double)height - 1);
-
-          // Ray calculation contains some randomness
-          auto tmpc1 = ray_color(cam.get_ray(u, v), background, objects, lights, max_depth);
-          auto tmpc2 = ray_color(cam.get_ray(u, v), background, objects, lights, max_depth);
-
-	  if(
-	     is_nan(tmpc1) || is_nan(tmpc2)
-	     || tmpc1.length() > MAX_COLOR || tmpc2.length() > MAX_COLOR
-	     ) {
-	    // std::cerr << "Color either NaN or too large: " << tmpc1 << ", " << tmpc2 << std::endl;
-	    s -= 2;
-	    continue;
-	  }
-
-#ifdef SAMPLE_CLAMP
-          c1 += clamp_color(tmpc1, SAMPLE_CLAMP);
-          c2 += clamp_color(tmpc2, SAMPLE_CLAMP);
-#else
-          c1 += tmpc1;
-          c2 += tmpc2;
-#endif
-          count += 2;
-        }
-
-        // Adaptive loop
-        for(int s = min_samples_per_pixel / 2; s < max_samples_per_pixel / 2; s++) {
-          auto u = (i + random_double()) / ((double)width - 1);
-          auto v = (j + random_double()) / ((double)height - 1);
-
-          auto tmpc1 = ray_color(cam.get_ray(u, v), background, objects, lights, max_depth);
-          auto tmpc2 = ray_color(cam.get_ray(u, v), background, objects, lights, max_depth);
+  std::cerr << "Begin (" << tiles.size() << " tiles on " << threads << " threads)" << std::endl;
+  const int64_t tile_total = tiles.size();
+  RenderStats stats;
+  CheckpointWriter checkpoints(width, height, filename);
+  ProgressReporter progress(stats, tile_total, (int64_t)width * height);
+  auto render_tiles = [
+    &width,
+    &height,
+    &data,
+    &tiles,
+    &cam,
+    &scene,
+    &light_sampler,
+    &path_settings,
+    &pincer_limit,
+    &min_samples_per_pixel,
+    &max_samples_per_pixel,
+    &tile_total,
+    &stats,
+    &checkpoints,
+    &background,
+    &deterministic,
+    &seed,
+    &sampler_type,
+    &wavefront,
+    &wavefront_size,
+    &packet_size
+  ] () {
+    Sampler sampler(sampler_type, seed);
+    active_sampler() = &sampler;
+
+    // Traces one camera sample through pixel (i, j)
+    auto trace_sample = [&](int i, int j, uint64_t pixel, uint64_t sample_index) {
+      if(deterministic)
+        seed_sample(seed, pixel, sample_index);
+      sampler.start_sample(pixel, sample_index);
+
+      double du, dv;
+      sampler.get_2d(du, dv);
+      auto u = (i + du) / ((double)width - 1);
+      auto v = (j + dv) / ((double)height - 1);
+
+      // Ray calculation contains some randomness
+      return ray_color(cam.get_ray(u, v), background, *scene, light_sampler, path_settings);
+    };
+
+    // Traces count samples of pixel (i, j) from sample_index on, like
+    // trace_sample, but intersects their camera rays as one packet.
+    const bool use_packets = packet_size >= 2 && cam.is_pinhole();
+    auto trace_packet = [&](int i, int j, uint64_t pixel, uint64_t sample_index, int count, Color colors[]) {
+      RayPacket packet;
+      packet.size = count;
+      Pcg32 rngs[max_packet_size];
+      Sampler samplers[max_packet_size];
+      for(int k = 0; k < count; k++) {
+        if(deterministic)
+          seed_sample(seed, pixel, sample_index + k);
+        sampler.start_sample(pixel, sample_index + k);
+
+        double du, dv;
+        sampler.get_2d(du, dv);
+        auto u = (i + du) / ((double)width - 1);
+        auto v = (j + dv) / ((double)height - 1);
+        packet.rays[k] = cam.get_ray(u, v);
+
+        rngs[k] = thread_rng();
+        samplers[k] = sampler;
+      }
 
-	  if(
-	     is_nan(tmpc1) || is_nan(tmpc2)
-	     || tmpc1.length() > MAX_COLOR || tmpc2.length() > MAX_COLOR
-             ) {
-	    // std::cerr << "Color either NaN or too large: " << tmpc1 << ", " << tmpc2 << std::endl;
-	    s -= 2;
-	    continue;
-	  }
+      HitRecord recs[max_packet_size];
+      bool hits[max_packet_size];
+      thread_counters().rays += count;
+      scene->hit_packet(packet, 0.001, infinity, recs, hits);
+
+      // Carry on each path where its own sample left off. Without
+      // deterministic seeding the samples share the thread's generator,
+      // which just keeps running.
+      for(int k = 0; k < count; k++) {
+        if(deterministic)
+          thread_rng() = rngs[k];
+        sampler = samplers[k];
+        colors[k] = trace_path(
+          packet.rays[k], hits[k], recs[k], background, *scene, light_sampler, path_settings
+        );
+      }
+    };
+
+    // Adds a pair of samples to a pixel's two estimates and returns 0. When
+    // either sample is unusable it adds nothing and returns 2, the number of
+    // extra pairs the pixel has to take: one in place of this pair and one
+    // more. Every render path retries by this count, so they all take the
+    // same samples.
+    auto add_pair = [](Color &c1, Color &c2, int64_t &count, const Color &tmpc1, const Color &tmpc2) {
+      if(
+         is_nan(tmpc1) || is_nan(tmpc2)
+         || tmpc1.length() > MAX_COLOR || tmpc2.length() > MAX_COLOR
+         ) {
+        // std::cerr << "Color either NaN or too large: " << tmpc1 << ", " << tmpc2 << std::endl;
+        return 2;
+      }
 
 #ifdef SAMPLE_CLAMP
-          c1 += clamp_color(tmpc1, SAMPLE_CLAMP);
-          c2 += clamp_color(tmpc2, SAMPLE_CLAMP);
+      c1 += clamp_color(tmpc1, SAMPLE_CLAMP);
+      c2 += clamp_color(tmpc2, SAMPLE_CLAMP);
 #else
-          c1 += tmpc1;
-          c2 += tmpc2;
+      c1 += tmpc1;
+      c2 += tmpc2;
 #endif
-          count += 2;
+      count += 2;
+      return 0;
+    };
+
+    // Whether the two halves of a pixel's samples agree closely enough to
+    // stop sampling it
+    auto converged = [&](const Color &c1, const Color &c2) {
+      auto dist = fabs((c1.x() - c2.x()) + (c1.y() - c2.y()) + (c1.z() - c2.z()));
+      auto total = (c1.x() + c2.x()) + (c1.y() + c2.y()) + (c1.z() + c2.z());
+      return dist / total < pincer_limit;
+    };
+
+    auto store_pixel = [&](int i, int j, const Color &c1, const Color &c2, int64_t count) {
+      data[((int64_t)height - j - 1) * width * 3 + i * 3 + 0] = (c1 + c2).x() / count;
+      data[((int64_t)height - j - 1) * width * 3 + i * 3 + 1] = (c1 + c2).y() / count;
+      data[((int64_t)height - j - 1) * width * 3 + i * 3 + 2] = (c1 + c2).z() / count;
+    };
+
+    // Samples every pixel of a tile one pair at a time with ray_color
+    auto render_tile_megakernel = [&](const Tile &tile, int64_t &tile_sample_count, int64_t &local_reached_max) {
+      for(int j = tile.y0; j < tile.y1; ++j) {
+        for (int i = tile.x0; i < tile.x1; ++i) {
+          // Pre-emptively increase max counter
+          local_reached_max++;
+          Color c1(0, 0, 0), c2(0, 0, 0);
+          int64_t count = 0;
+          // Counts rejected samples too, so a retry never repeats the numbers
+          // of the sample it replaces.
+          uint64_t sample_index = 0;
+          uint64_t pixel = (uint64_t)j * width + i;
+          if(use_packets) {
+            // Same pairs as the loop below, a packet's worth at a time
+            int remaining = min_samples_per_pixel / 2;
+            while(remaining > 0) {
+              int pairs = std::min(remaining, packet_size / 2);
+              Color colors[max_packet_size];
+              trace_packet(i, j, pixel, sample_index, 2 * pairs, colors);
+              sample_index += 2 * pairs;
+              for(int p = 0; p < pairs; p++)
+                remaining += add_pair(c1, c2, count, colors[2 * p], colors[2 * p + 1]) - 1;
+            }
+          } else {
+            for(int s = 0; s < min_samples_per_pixel / 2; s++) {
+              auto tmpc1 = trace_sample(i, j, pixel, sample_index++);
+              auto tmpc2 = trace_sample(i, j, pixel, sample_index++);
+              s -= add_pair(c1, c2, count, tmpc1, tmpc2);
+            }
+          }
 
-          auto dist = fabs((c1.x() - c2.x()) + (c1.y() - c2.y()) + (c1.z() - c2.z()));
-          auto total = (c1.x() + c2.x()) + (c1.y() + c2.y()) + (c1.z() + c2.z());
-          if(dist / total < pincer_limit) {
-            // Restore max counter
-            local_reached_max--;
-            break;
+          // Adaptive loop
+          for(int s = min_samples_per_pixel / 2; s < max_samples_per_pixel / 2; s++) {
+            auto tmpc1 = trace_sample(i, j, pixel, sample_index++);
+            auto tmpc2 = trace_sample(i, j, pixel, sample_index++);
+            if(auto owed = add_pair(c1, c2, count, tmpc1, tmpc2)) {
+              s -= owed;
+              continue;
+            }
+
+            if(converged(c1, c2)) {
+              // Restore max counter
+              local_reached_max--;
+              break;
+            }
           }
-        }
 
-        line_sample_count += count;
-        data[((int64_t)height - j - 1) * width * 3 + i * 3 + 0] = (c1 + c2).x() / count;
-        data[((int64_t)height - j - 1) * width * 3 + i * 3 + 1] = (c1 + c2).y() / count;
-        data[((int64_t)height - j - 1) * width * 3 + i * 3 + 2] = (c1 + c2).z() / count;
+          tile_sample_count += count;
+          store_pixel(i, j, c1, c2, count);
+        }
       }
-
-      {
-        const std::lock_guard<std::mutex> lock(mutex);
-        ++line_count;
-        sample_count += line_sample_count;
-        std::cerr << "\rScanline " << line_count << "/" << height << std::flush;
-        samples_reached_max += local_reached_max;
-        std::cerr << "\rScanline "
-                  << line_count
-                  << "/"
-                  << height
-                  << " "
-                  << samples_reached_max
-                  << " ceilings hit and "
-                  << ((double)sample_count / (width * line_count))
-                  << " samples per pixel"
-                  << std::flush;
-        if (line_count > next_save) {
-          save_png(data, width, height, filename);
-          next_save += height / 10;
+    };
+
+    // Samples a tile in batches traced stage by stage. The first batches
+    // take every pixel's minimum samples at once; after that each batch
+    // takes one more pair from every pixel that hasn't converged yet.
+    Wavefront wave(
+      cam, *scene, light_sampler, background, path_settings,
+      sampler_type, seed, deterministic, width, height
+    );
+    std::vector<CameraSample> batch;
+    std::vector<Color> batch_colors;
+    struct PixelState {
+      Color c1, c2;
+      int64_t count;
+      uint64_t sample_index;
+      int pairs;
+      bool done;
+    };
+    std::vector<PixelState> tile_pixels;
+
+    auto render_tile_wavefront = [&](const Tile &tile, int64_t &tile_sample_count, int64_t &local_reached_max) {
+      const int tile_width = tile.x1 - tile.x0;
+      const int pixel_count = tile_width * (tile.y1 - tile.y0);
+      tile_pixels.assign(pixel_count, PixelState{Color(0, 0, 0), Color(0, 0, 0), 0, 0, 0, false});
+
+      // Queues pairs for every pixel short of target_pairs, at most
+      // max_pairs_per_pixel each and as many as fit in the batch. Returns
+      // false if no pixel wanted any.
+      auto fill_batch = [&](int target_pairs, int max_pairs_per_pixel) {
+        batch.clear();
+        bool wanted = false;
+        for(int p = 0; p < pixel_count; p++) {
+          auto &px = tile_pixels[p];
+          if(px.done)
+            continue;
+          int wanted_pairs = std::min(target_pairs - px.pairs, max_pairs_per_pixel);
+          wanted = wanted || wanted_pairs > 0;
+          for(int n = 0; n < wanted_pairs && batch.size() + 2 <= wavefront_size; n++) {
+            int i = tile.x0 + p % tile_width;
+            int j = tile.y0 + p / tile_width;
+            batch.push_back({i, j, px.sample_index++});
+            batch.push_back({i, j, px.sample_index++});
+          }
         }
+        return wanted;
+      };
+
+      // Adds the traced pairs to their pixels, in the order they were queued
+      auto gather_batch = [&](bool adaptive) {
+        wave.trace(batch, batch_colors);
+        for(size_t k = 0; k < batch.size(); k += 2) {
+          auto p = (batch[k].j - tile.y0) * tile_width + (batch[k].i - tile.x0);
+          auto &px = tile_pixels[p];
+          px.pairs++;
+          if(auto owed = add_pair(px.c1, px.c2, px.count, batch_colors[k], batch_colors[k + 1])) {
+            px.pairs -= owed;
+            continue;
+          }
+          if(adaptive && converged(px.c1, px.c2)) {
+            px.done = true;
+            local_reached_max--;
+          }
+        }
+      };
+
+      local_reached_max += pixel_count;
+      while(fill_batch(min_samples_per_pixel / 2, min_samples_per_pixel / 2))
+        gather_batch(false);
+      while(fill_batch(max_samples_per_pixel / 2, 1))
+        gather_batch(true);
+
+      for(int p = 0; p < pixel_count; p++) {
+        auto &px = tile_pixels[p];
+        tile_sample_count += px.count;
+        store_pixel(tile.x0 + p % tile_width, tile.y0 + p / tile_width, px.c1, px.c2, px.count);
       }
+    };
+
+    Tile tile;
+    while(tiles.next(tile)) {
+      int64_t tile_sample_count = 0;
+      int64_t local_reached_max = 0;
+      if(wavefront)
+        render_tile_wavefront(tile, tile_sample_count, local_reached_max);
+      else
+        render_tile_megakernel(tile, tile_sample_count, local_reached_max);
+      checkpoints.add_tile(tile, data);
+
+      stats.pixels.fetch_add((int64_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0), std::memory_order_relaxed);
+      stats.samples.fetch_add(tile_sample_count, std::memory_order_relaxed);
+      stats.ceilings_hit.fetch_add(local_reached_max, std::memory_order_relaxed);
+      stats.flush_thread_counters();
+
+      // Checkpoint whenever another tenth of the tiles is done
+      auto done = stats.tiles.fetch_add(1) + 1;
+      if(done * 10 / tile_total != (done - 1) * 10 / tile_total)
+        checkpoints.request();
     }
-  );
-  std::cerr << "\nRender complete." << std::endl;
-  std::cerr << "Average " << ((double)sample_count / ((double)width * height)) << " samples per pixel" << std::endl;
+    active_sampler() = nullptr;
+  };
+
+  std::vector<std::thread> workers;
+  for(int t = 0; t < threads; t++)
+    workers.emplace_back(render_tiles);
+  for(auto &worker : workers)
+    worker.join();
+  checkpoints.stop();
+  progress.stop();
+
+  std::cerr << "\nRender complete in " << progress.elapsed() << " s." << std::endl;
+  // No samples are taken of an empty image
+  const double pixel_count = (double)width * height;
+  const double samples_per_pixel = pixel_count > 0 ? stats.samples / pixel_count : 0.0;
+  const double rays_per_sample = stats.samples > 0 ? (double)stats.rays / stats.samples : 0.0;
+  std::cerr << "Average " << samples_per_pixel << " samples per pixel" << std::endl;
+  std::cerr << "Traced " << stats.rays << " rays, "
+            << rays_per_sample << " per sample" << std::endl;
+  std::cerr << "Russian roulette ended " << stats.roulette_terminations << " paths early, saving up to "
+            << stats.roulette_bounces_saved << " bounces" << std::endl;
 
   // Dump image
   std::cerr << "Saving image to '" << filename << "'" << std::endl;
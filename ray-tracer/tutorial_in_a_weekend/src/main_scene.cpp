@@ -52,6 +52,7 @@ Color ray_color(const Ray &r, const Hittable &world, int depth)
     return Color(0, 0, 0);
 
   if(world.hit(r, 0.001, infinity, rec)) {
+    rec.resolve(r);
     Ray scattered;
     Color attenuation;
     if(rec.material->scatter(r, rec, attenuation, scattered))
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <memory>
+#include <variant>
 
 #include "rtweekend.hpp"
 
@@ -12,16 +13,32 @@
 
 class HitRecord;
 
+// The PDFs a material can scatter with. They're stored by value in the
+// ScatterRecord so scattering never allocates.
+using ScatterPdf = std::variant<std::monostate, CosinePdf>;
+
 struct ScatterRecord {
     Ray specular_ray;
     bool is_specular;
     Color attenuation;
-    std::shared_ptr<Pdf> pdf;
+    ScatterPdf pdf;
+
+    const Pdf *get_pdf() const {
+      if(auto cosine = std::get_if<CosinePdf>(&pdf))
+        return cosine;
+      return nullptr;
+    }
 };
 
 class Material {
 public:
-  void setName(std::string n) {name = n;}
+  // The material classes defined here, so the hot path can switch on the
+  // type instead of making virtual calls. Anything else is Other.
+  enum class Type {Other, Lambertian, Metal, Dielectric, DiffuseLight, Isotropic};
+
+  Material() : type(Type::Other) {}
+  Material(Type t) : type(t) {}
+
   virtual bool scatter(
     const Ray& r_in, const HitRecord& rec, ScatterRecord &srec
   ) const {
@@ -36,12 +53,18 @@ public:
   {
     return Color(0, 0, 0);
   }
+  // Typical radiance emitted from the front face, used to weigh lights
+  // against each other
+  virtual Color emission() const
+  {
+    return Color(0, 0, 0);
+  }
   virtual void serialize(std::ostream &out) const {
     out << "Unknown material type";
   }
 
 public:
-  std::string name;
+  Type type;
 };
 inline std::ostream& operator<<(std::ostream &out, const Material &m)
 {
@@ -49,10 +72,10 @@ inline std::ostream& operator<<(std::ostream &out, const Material &m)
   return out;
 }
 
-class Lambertian : public Material {
+class Lambertian final : public Material {
 public:
-  Lambertian(const Color &a) : albedo(new SolidColor(a)), allocated(true) {}
-  Lambertian(Texture *a) : albedo(a), allocated(false) {}
+  Lambertian(const Color &a) : Material(Type::Lambertian), albedo(new SolidColor(a)), allocated(true) {}
+  Lambertian(Texture *a) : Material(Type::Lambertian), albedo(a), allocated(false) {}
   virtual ~Lambertian() { if (allocated) delete albedo; }
 
   virtual bool scatter(
@@ -60,14 +83,14 @@ public:
   ) const override
   {
     srec.is_specular = false;
-    srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-    srec.pdf = std::make_shared<CosinePdf>(rec.normal);
+    srec.attenuation = texture_value(albedo, rec.u, rec.v, rec.p);
+    srec.pdf = CosinePdf(rec.normal);
     return true;
   }
 
-  double scattering_pdf(
+  virtual double scattering_pdf(
     const Ray &r_in, const HitRecord &rec, const Ray &scattered
-  ) const {
+  ) const override {
     auto cosine = dot(rec.normal, unit_vector(scattered.direction()));
     return cosine < 0 ? 0 : cosine/pi;
   }
@@ -84,9 +107,9 @@ public:
   bool allocated;
 };
 
-class Metal : public Material {
+class Metal final : public Material {
 public:
-  Metal(const Color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+  Metal(const Color& a, double f) : Material(Type::Metal), albedo(a), fuzz(f < 1 ? f : 1) {}
 
   virtual bool scatter(
     const Ray &r_in, const HitRecord &rec, ScatterRecord &srec
@@ -95,7 +118,7 @@ public:
     srec.specular_ray = Ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
     srec.attenuation = albedo;
     srec.is_specular = true;
-    srec.pdf = 0;
+    srec.pdf = std::monostate();
     return true;
   }
 
@@ -104,9 +127,9 @@ public:
   double fuzz;
 };
 
-class Dielectric : public Material {
+class Dielectric final : public Material {
 public:
-  Dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+  Dielectric(double index_of_refraction) : Material(Type::Dielectric), ir(index_of_refraction) {}
 
   virtual bool scatter(
     const Ray &r_in, const HitRecord &rec, ScatterRecord &srec
@@ -144,11 +167,11 @@ private:
   }
 };
 
-class DiffuseLight : public Material
+class DiffuseLight final : public Material
 {
 public:
-  DiffuseLight(Texture *a) : emit(a) {}
-  DiffuseLight(Color c) : emit(new SolidColor(c)) {}
+  DiffuseLight(Texture *a) : Material(Type::DiffuseLight), emit(a) {}
+  DiffuseLight(Color c) : Material(Type::DiffuseLight), emit(new SolidColor(c)) {}
 
   virtual bool scatter(
     const Ray &ray_in, const HitRecord &rec, ScatterRecord &srec
@@ -165,20 +188,26 @@ public:
   ) const override
   {
     if(rec.front_face)
-      return emit->value(u, v, p);
+      return texture_value(emit, u, v, p);
     else
       return Color(0, 0, 0);
   }
 
+  virtual Color emission() const override
+  {
+    // Exact for solid colors, a rough guess for anything else
+    return emit->value(0.5, 0.5, Point3(0, 0, 0));
+  }
+
 public:
   Texture *emit;
 };
 
-class Isotropic : public Material
+class Isotropic final : public Material
 {
 public:
-  Isotropic(Color c) : albedo(new SolidColor(c)) {}
-  Isotropic(Texture *a) : albedo(a) {}
+  Isotropic(Color c) : Material(Type::Isotropic), albedo(new SolidColor(c)) {}
+  Isotropic(Texture *a) : Material(Type::Isotropic), albedo(a) {}
 
   virtual bool scatter(
     const Ray &ray_in, const HitRecord &rec, ScatterRecord &srec
@@ -186,7 +215,7 @@ public:
     // Just guessing, don't even know what this material is for
     srec.is_specular = true;
     srec.specular_ray = Ray(rec.p, random_in_unit_sphere(), ray_in.time());
-    srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
+    srec.attenuation = texture_value(albedo, rec.u, rec.v, rec.p);
     return true;
   }
 
@@ -194,4 +223,62 @@ public:
   Texture *albedo;
 };
 
+// The functions below do the same as the Material methods of the same name,
+// but call the material classes above directly so the compiler can inline
+// them into the integrator.
+
+inline bool material_scatter(
+  const Material *material, const Ray &r_in, const HitRecord &rec, ScatterRecord &srec
+)
+{
+  switch(material->type) {
+    case Material::Type::Lambertian:
+      return static_cast<const Lambertian*>(material)->scatter(r_in, rec, srec);
+    case Material::Type::Metal:
+      return static_cast<const Metal*>(material)->scatter(r_in, rec, srec);
+    case Material::Type::Dielectric:
+      return static_cast<const Dielectric*>(material)->scatter(r_in, rec, srec);
+    case Material::Type::DiffuseLight:
+      return false;
+    case Material::Type::Isotropic:
+      return static_cast<const Isotropic*>(material)->scatter(r_in, rec, srec);
+    default:
+      return material->scatter(r_in, rec, srec);
+  }
+}
+
+inline double material_scattering_pdf(
+  const Material *material, const Ray &r_in, const HitRecord &rec, const Ray &scattered
+)
+{
+  switch(material->type) {
+    case Material::Type::Lambertian:
+      return static_cast<const Lambertian*>(material)->scattering_pdf(r_in, rec, scattered);
+    case Material::Type::Metal:
+    case Material::Type::Dielectric:
+    case Material::Type::DiffuseLight:
+    case Material::Type::Isotropic:
+      return 0;
+    default:
+      return material->scattering_pdf(r_in, rec, scattered);
+  }
+}
+
+inline Color material_emitted(
+  const Material *material, const Ray &ray_in, const HitRecord &rec, double u, double v, const Point3 &p
+)
+{
+  switch(material->type) {
+    case Material::Type::DiffuseLight:
+      return static_cast<const DiffuseLight*>(material)->emitted(ray_in, rec, u, v, p);
+    case Material::Type::Lambertian:
+    case Material::Type::Metal:
+    case Material::Type::Dielectric:
+    case Material::Type::Isotropic:
+      return Color(0, 0, 0);
+    default:
+      return material->emitted(ray_in, rec, u, v, p);
+  }
+}
+
 #endif
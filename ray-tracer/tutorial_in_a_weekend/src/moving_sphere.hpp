@@ -13,9 +13,9 @@ public:
   MovingSphere(
     Point3 center0,
     Point3 center1,
-    double time0,
-    double time1,
-    double radius,
+    real time0,
+    real time1,
+    real radius,
     Material *material
   ) :
     center0(center0),
@@ -47,26 +47,36 @@ public:
   virtual bool hit(
     const Ray &ray, double t_min, double t_max, HitRecord &rec
   ) const override;
+  virtual bool occluded(const Ray &ray, double t_min, double t_max) const override;
+  virtual void finalize_hit(const Ray &ray, HitRecord &rec) const override;
   virtual bool bounding_box(
     double time0, double time1, Aabb &output_box
   ) const override;
-  Point3 center(double time) const;
+  virtual double emitted_power() const override
+  {
+    return pi * 4 * pi * radius * radius * luminance(material->emission());
+  }
+  Point3 center(real time) const;
 
 public:
   Point3 center0;
   Point3 center1;
-  double time0;
-  double time1;
-  double radius;
+  real time0;
+  real time1;
+  real radius;
   Material *material;
+
+private:
+  // Finds the nearest root of the ray/sphere equation within [t_min, t_max]
+  bool nearest_root(const Ray &ray, double t_min, double t_max, real &root) const;
 };
 
-Point3 MovingSphere::center(double time) const
+Point3 MovingSphere::center(real time) const
 {
   return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
 
-bool MovingSphere::hit(const Ray& ray, double t_min, double t_max, HitRecord& rec) const
+bool MovingSphere::nearest_root(const Ray &ray, double t_min, double t_max, real &root) const
 {
   Vec3 oc = ray.origin() - center(ray.time());
   auto a = ray.direction().length_squared();
@@ -79,20 +89,38 @@ bool MovingSphere::hit(const Ray& ray, double t_min, double t_max, HitRecord& re
   auto sqrtd = sqrt(discriminant);
 
   // Find the nearest root that lies in the acceptable range.
-  auto root = (-half_b - sqrtd) / a;
+  root = (-half_b - sqrtd) / a;
   if (root < t_min || t_max < root) {
     root = (-half_b + sqrtd) / a;
     if (root < t_min || t_max < root)
       return false;
   }
 
-  rec.t = root;
+  return true;
+}
+
+bool MovingSphere::hit(const Ray& ray, double t_min, double t_max, HitRecord& rec) const
+{
+  real root;
+  if(!nearest_root(ray, t_min, t_max, root))
+    return false;
+
+  rec.defer(root, this);
+  return true;
+}
+
+void MovingSphere::finalize_hit(const Ray &ray, HitRecord &rec) const
+{
   rec.p = ray.at(rec.t);
   auto outward_normal = (rec.p - center(ray.time())) / radius;
   rec.set_face_normal(ray, outward_normal);
   rec.material = material;
+}
 
-  return true;
+bool MovingSphere::occluded(const Ray &ray, double t_min, double t_max) const
+{
+  real root;
+  return nearest_root(ray, t_min, t_max, root);
 }
 
 bool MovingSphere::bounding_box(double time0, double time1, Aabb &output_box) const
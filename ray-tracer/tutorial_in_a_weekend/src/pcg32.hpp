@@ -0,0 +1,48 @@
+#ifndef PCG32_HPP
+#define PCG32_HPP
+
+#include <cstdint>
+
+// PCG32 random number generator (https://www.pcg-random.org), the
+// XSH-RR variant with 64 bits of state. Generators seeded with different
+// streams produce independent sequences even from the same initial state.
+class Pcg32 {
+public:
+  static const uint64_t default_state = 0x853c49e6748fea9bULL;
+  static const uint64_t default_stream = 0xda3e39cb94b95bdbULL;
+
+  Pcg32(uint64_t initial_state = default_state, uint64_t stream = default_stream)
+  {
+    seed(initial_state, stream);
+  }
+
+  void seed(uint64_t initial_state, uint64_t stream)
+  {
+    state = 0;
+    inc = (stream << 1u) | 1u;
+    next_uint();
+    state += initial_state;
+    next_uint();
+  }
+
+  uint32_t next_uint()
+  {
+    uint64_t old_state = state;
+    state = old_state * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+    uint32_t rot = static_cast<uint32_t>(old_state >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  // Returns a random real in [0,1).
+  double next_double()
+  {
+    return next_uint() * 0x1p-32;
+  }
+
+public:
+  uint64_t state;
+  uint64_t inc;
+};
+
+#endif
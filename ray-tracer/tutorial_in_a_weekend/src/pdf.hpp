@@ -32,7 +32,7 @@ public:
 
 class HittablePdf: public Pdf {
 public:
-  HittablePdf(Hittable *p, const Point3 &origin): ptr(p), o(origin) {}
+  HittablePdf(const Hittable *p, const Point3 &origin): ptr(p), o(origin) {}
 
   virtual double value(const Vec3& direction) const override {
     auto retval = ptr->pdf_value(o, direction);
@@ -47,13 +47,15 @@ public:
   }
 
 public:
-  Hittable *ptr;
+  const Hittable *ptr;
   Point3 o;
 };
 
+// Picks either of two PDFs with equal probability. The PDFs are referenced,
+// not owned, so a mixture of stack allocated PDFs costs no allocation.
 class MixturePdf : public Pdf {
 public:
-  MixturePdf(std::shared_ptr<Pdf> p0, std::shared_ptr<Pdf> p1)
+  MixturePdf(const Pdf *p0, const Pdf *p1)
   {
     p[0] = p0;
     p[1] = p1;
@@ -73,7 +75,7 @@ public:
   }
 
 public:
-  std::shared_ptr<Pdf> p[2];
+  const Pdf *p[2];
 };
 
 inline Vec3 random_to_sphere(double radius, double distance_squared)
@@ -0,0 +1,127 @@
+#ifndef PNG_WRITER_HPP
+#define PNG_WRITER_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stb_image_write.h"
+
+#include "rtweekend.hpp"
+#include "tile_scheduler.hpp"
+
+void save_png(std::vector<double> &data, const int width, const int height, const char *filename)
+{
+  int y, x;
+  uint8_t *pixels;
+  const int64_t pitch = width * 3;
+  pixels = new uint8_t[data.size()];
+
+  // Change from RGB to BGR because PNG sucks.
+  for(y=0; y<height; y++) {
+    for(x=0; x < pitch; x += 3) {
+      auto r = data[(int64_t)y * pitch + x + 0LL];
+      auto g = data[(int64_t)y * pitch + x + 1LL];
+      auto b = data[(int64_t)y * pitch + x + 2LL];
+
+      pixels[(int64_t)y * pitch + x + 0LL] = static_cast<int>(256 * clamp(sqrt(r), 0.0, 0.999));
+      pixels[(int64_t)y * pitch + x + 1LL] = static_cast<int>(256 * clamp(sqrt(g), 0.0, 0.999));
+      pixels[(int64_t)y * pitch + x + 2LL] = static_cast<int>(256 * clamp(sqrt(b), 0.0, 0.999));
+    }
+  }
+
+  stbi_write_png( filename, width, height, STBI_rgb, pixels, (int)pitch );
+  delete[] pixels;
+}
+
+// Writes progress checkpoints of an image on a thread of its own, so the
+// render threads never wait for PNG encoding. Render threads hand over each
+// tile once it's finished, and the writer only ever sees those copies, never
+// the image the render threads are writing to.
+class CheckpointWriter {
+public:
+  CheckpointWriter(int width, int height, const char *filename)
+    : width(width), height(height), filename(filename),
+      finished(3LL * height * width), pending(false), stopping(false)
+  {
+    thread = std::thread(&CheckpointWriter::run, this);
+  }
+
+  ~CheckpointWriter() { stop(); }
+
+  // Copies a tile the calling thread has finished rendering out of data,
+  // which is laid out like the image passed to save_png
+  void add_tile(const Tile &tile, const std::vector<double> &data)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(int j = tile.y0; j < tile.y1; ++j) {
+      auto row = ((int64_t)height - j - 1) * width * 3;
+      std::copy(
+        data.begin() + row + tile.x0 * 3, data.begin() + row + tile.x1 * 3,
+        finished.begin() + row + tile.x0 * 3
+      );
+    }
+  }
+
+  // Asks for a checkpoint to be written and returns straight away. Requests
+  // made while a checkpoint is being written are merged into one.
+  void request()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending = true;
+    }
+    wake.notify_one();
+  }
+
+  // Writes any outstanding checkpoint and joins the writer thread
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(stopping)
+        return;
+      stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+  }
+
+public:
+  int width;
+  int height;
+  std::string filename;
+
+private:
+  void run()
+  {
+    while(true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this] { return pending || stopping; });
+        if(!pending)
+          return;
+        pending = false;
+        snapshot = finished;
+      }
+
+      save_png(snapshot, width, height, filename.c_str());
+    }
+  }
+
+  // The tiles finished so far, guarded by mutex, and the copy of them the
+  // writer encodes
+  std::vector<double> finished;
+  std::vector<double> snapshot;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool pending;
+  bool stopping;
+  std::thread thread;
+};
+
+#endif
@@ -1,31 +1,74 @@
 #ifndef RAY_H
 #define RAY_H
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <type_traits>
 
 #include "vec3.hpp"
 
 class Ray {
 public:
   Ray() {}
-  Ray(const Point3& origin, const Vec3& direction, double time = 0.0)
-    : orig(origin), dir(direction), tm(time)
-  {}
+  Ray(const Point3& origin, const Vec3& direction, real time = 0.0)
+    : orig(origin), dir(direction), tm(time),
+      inv_dir(1 / direction.x(), 1 / direction.y(), 1 / direction.z())
+  {
+    for(int a = 0; a < 3; a++)
+      sign[a] = inv_dir[a] < 0;
+  }
 
   Point3 origin() const  { return orig; }
   Vec3 direction() const { return dir; }
-  double time() const    { return tm; }
+  real time() const      { return tm; }
 
-  Point3 at(double t) const {
+  Point3 at(real t) const {
     return orig + t * dir;
   }
 
 public:
   Point3 orig;
   Vec3 dir;
-  double tm;
+  real tm;
+  // For slab tests: the reciprocal of each direction component, and whether
+  // it is negative, which picks the near and far plane of a box without a
+  // branch
+  Vec3 inv_dir;
+  uint8_t sign[3];
 };
 
+// Moves p, a point on a surface with normal n, off the surface to the side
+// that w points to. Far from the origin the step is a fixed number of units
+// in the last place of each coordinate, so it stays just larger than the
+// rounding error in p whatever its magnitude and whether real is float or
+// double. Rays leaving from the returned point can't hit the surface they
+// left again. From "A Fast and Robust Method for Avoiding Self-Intersection"
+// (Waechter and Binder, Ray Tracing Gems, 2019).
+inline Point3 offset_ray_origin(const Point3 &p, const Vec3 &n, const Vec3 &w)
+{
+  using Bits = std::conditional<sizeof(real) == 4, int32_t, int64_t>::type;
+  const real origin = 1.0 / 32;
+  const real float_scale = 1.0 / 65536;
+  const real int_scale = 256;
+
+  auto normal = dot(n, w) < 0 ? -n : n;
+  Point3 offset;
+  for(int a = 0; a < 3; a++) {
+    if(std::fabs(p.e[a]) < origin) {
+      // Close to zero the units in the last place get too small to be any use
+      offset.e[a] = p.e[a] + float_scale * normal.e[a];
+      continue;
+    }
+    auto step = static_cast<Bits>(int_scale * normal.e[a]);
+    Bits bits;
+    std::memcpy(&bits, &p.e[a], sizeof(real));
+    bits += (p.e[a] < 0) ? -step : step;
+    std::memcpy(&offset.e[a], &bits, sizeof(real));
+  }
+  return offset;
+}
+
 inline std::ostream& operator<<(std::ostream &out, const Ray &r)
 {
   return out << "Ray(" << r.origin() << ", " << r.direction() << ')';
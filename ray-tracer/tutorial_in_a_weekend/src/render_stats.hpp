@@ -0,0 +1,129 @@
+#ifndef RENDER_STATS_HPP
+#define RENDER_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+// Counters for the hot path of the calling thread, kept thread local so
+// tracing never touches shared memory. Flushed into the RenderStats totals
+// once per tile.
+struct ThreadCounters {
+  int64_t rays = 0;
+  // Paths ended by Russian roulette, and the bounces they had left before
+  // reaching the maximum depth
+  int64_t roulette_terminations = 0;
+  int64_t roulette_bounces_saved = 0;
+};
+
+inline ThreadCounters &thread_counters()
+{
+  thread_local ThreadCounters counters;
+  return counters;
+}
+
+// Totals for the whole render. Threads add to them once per tile.
+struct RenderStats {
+  std::atomic<int64_t> tiles{0};
+  std::atomic<int64_t> pixels{0};
+  std::atomic<int64_t> samples{0};
+  std::atomic<int64_t> rays{0};
+  std::atomic<int64_t> ceilings_hit{0};
+  std::atomic<int64_t> roulette_terminations{0};
+  std::atomic<int64_t> roulette_bounces_saved{0};
+
+  // Moves the calling thread's counters into the totals
+  void flush_thread_counters()
+  {
+    auto &counters = thread_counters();
+    rays.fetch_add(counters.rays, std::memory_order_relaxed);
+    roulette_terminations.fetch_add(counters.roulette_terminations, std::memory_order_relaxed);
+    roulette_bounces_saved.fetch_add(counters.roulette_bounces_saved, std::memory_order_relaxed);
+    counters = ThreadCounters();
+  }
+};
+
+// Prints a progress line for a render from a thread of its own, at most
+// once per interval, so render threads never wait on stderr.
+class ProgressReporter {
+public:
+  ProgressReporter(const RenderStats &stats, int64_t total_tiles, int64_t total_pixels, double interval = 1.0)
+    : stats(stats), total_tiles(total_tiles), total_pixels(total_pixels),
+      interval(interval), stopping(false),
+      start(std::chrono::steady_clock::now())
+  {
+    thread = std::thread(&ProgressReporter::run, this);
+  }
+
+  ~ProgressReporter() { stop(); }
+
+  // Prints a final progress line and joins the reporter thread
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(stopping)
+        return;
+      stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+    report();
+  }
+
+  double elapsed() const
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+public:
+  const RenderStats &stats;
+  int64_t total_tiles;
+  int64_t total_pixels;
+  double interval;
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(!wake.wait_for(
+      lock, std::chrono::duration<double>(interval), [this] { return stopping; }
+    )) {
+      report();
+    }
+  }
+
+  void report() const
+  {
+    auto seconds = elapsed();
+    auto tiles = stats.tiles.load(std::memory_order_relaxed);
+    auto pixels = stats.pixels.load(std::memory_order_relaxed);
+    auto samples = stats.samples.load(std::memory_order_relaxed);
+    auto rays = stats.rays.load(std::memory_order_relaxed);
+
+    std::ostringstream line;
+    line << "\rTile " << tiles << "/" << total_tiles
+         << " " << stats.ceilings_hit.load(std::memory_order_relaxed) << " ceilings hit, "
+         << (pixels ? (double)samples / pixels : 0.0) << " samples per pixel, "
+         << (seconds > 0 ? rays / seconds / 1e6 : 0.0) << " Mrays/s, "
+         << (seconds > 0 ? samples / seconds / 1e3 : 0.0) << " ksamples/s";
+    if(pixels > 0 && pixels < total_pixels)
+      line << ", ETA " << (int64_t)(seconds * (total_pixels - pixels) / pixels) << " s";
+    line << "   ";
+
+    std::cerr << line.str() << std::flush;
+  }
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping;
+  std::chrono::steady_clock::time_point start;
+  std::thread thread;
+};
+
+#endif
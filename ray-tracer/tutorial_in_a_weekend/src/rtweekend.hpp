@@ -1,14 +1,26 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
+#include <atomic>
 #include <cmath>
 #include <limits>
 #include <memory>
 
+#include "pcg32.hpp"
+
 // Usings
 
 using std::sqrt;
 
+// Scalar type of the geometry: vectors, rays, hit records and primitives.
+// Builds with RAYTRACER_FLOAT defined use float, which halves the memory
+// traffic of traversal at the cost of precision.
+#ifdef RAYTRACER_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
+
 // Constants
 
 const double infinity = std::numeric_limits<double>::infinity();
@@ -21,10 +33,38 @@ inline double degrees_to_radians(double degrees)
   return degrees * pi / 180.0;
 }
 
+inline Pcg32 &thread_rng()
+{
+  // Every thread draws from its own stream, so sampling threads never share
+  // generator state or contend on a lock the way rand() does.
+  static std::atomic<uint64_t> next_stream(0);
+  thread_local Pcg32 rng(Pcg32::default_state, next_stream++);
+  return rng;
+}
+
+inline uint64_t mix_bits(uint64_t v)
+{
+  // SplitMix64 finalizer, scatters nearby integers across all 64 bits
+  v ^= v >> 31;
+  v *= 0x7fb5d329728ea185ULL;
+  v ^= v >> 27;
+  v *= 0x81dadef4bc2dd44dULL;
+  v ^= v >> 33;
+  return v;
+}
+
+inline void seed_sample(uint64_t seed, uint64_t pixel, uint64_t sample)
+{
+  // Restarts the calling thread's generator on a stream of its own for this
+  // pixel and sample, so the sample draws the same numbers no matter which
+  // thread, machine or order it's rendered in.
+  thread_rng().seed(mix_bits(seed ^ mix_bits(sample)), pixel);
+}
+
 inline double random_double()
 {
   // Returns a random real in [0,1).
-  return rand() / (RAND_MAX + 1.0);
+  return thread_rng().next_double();
 }
 
 inline double random_double(double min, double max)
@@ -50,6 +90,7 @@ inline double clamp(double x, double min, double max)
 
 // Common Headers
 
+#include "sampler.hpp"
 #include "ray.hpp"
 #include "vec3.hpp"
 #include "color.hpp"
@@ -0,0 +1,147 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <cstdint>
+#include <string>
+
+#include "rtweekend.hpp"
+
+// Scrambling functions from "Practical Hash-based Owen Scrambling"
+// (Burley 2020, https://jcgt.org/published/0009/04/01/).
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+// Owen scrambles a 32-bit fixed point fraction: every bit is flipped
+// depending on a hash of the bits above it.
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+  x = reverse_bits(x);
+  x = laine_karras_permutation(x, seed);
+  return reverse_bits(x);
+}
+
+// The first two dimensions of the Sobol sequence as 32-bit fractions. Together
+// they form a (0,2)-sequence: every power of two prefix is stratified in 2D.
+inline uint32_t sobol_dim0(uint32_t index)
+{
+  return reverse_bits(index);
+}
+
+inline uint32_t sobol_dim1(uint32_t index)
+{
+  uint32_t result = 0;
+  for(uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if(index & 1)
+      result ^= v;
+  }
+  return result;
+}
+
+// Hands out the sample values for one pixel sample at a time, a pair of
+// dimensions at a time.
+//
+// "sobol" pads the 2D Sobol (0,2)-sequence out to higher dimensions: every
+// pair of dimensions gets its own Owen scrambling and its own shuffle of
+// the sample order, seeded from the pixel, which keeps each pair well
+// stratified while decorrelating them. "random" is plain uniform random.
+class Sampler {
+public:
+  enum class Type { Random, Sobol };
+
+  // Dimension pairs beyond this fall back to uniform random numbers
+  static const int max_dimensions = 32;
+
+  Sampler(Type type = Type::Random, uint64_t seed = 0)
+    : type(type), seed(seed), pixel_seed(0), index(0), dimension(0) {}
+
+  static bool parse_type(const std::string &name, Type &type)
+  {
+    if(name == "random")
+      type = Type::Random;
+    else if(name == "sobol")
+      type = Type::Sobol;
+    else
+      return false;
+    return true;
+  }
+
+  void start_sample(uint64_t pixel, uint64_t sample_index)
+  {
+    pixel_seed = mix_bits(seed ^ mix_bits(pixel));
+    index = static_cast<uint32_t>(sample_index);
+    dimension = 0;
+  }
+
+  void get_2d(double &x, double &y)
+  {
+    if(type == Type::Random || dimension >= max_dimensions) {
+      x = random_double();
+      y = random_double();
+      return;
+    }
+
+    auto dim_seed = mix_bits(pixel_seed + dimension++);
+    auto shuffled = nested_uniform_scramble(index, static_cast<uint32_t>(dim_seed));
+    x = nested_uniform_scramble(sobol_dim0(shuffled), static_cast<uint32_t>(dim_seed >> 32)) * 0x1p-32;
+    y = nested_uniform_scramble(sobol_dim1(shuffled), static_cast<uint32_t>(mix_bits(dim_seed))) * 0x1p-32;
+  }
+
+  double get_1d()
+  {
+    double x, y;
+    get_2d(x, y);
+    return x;
+  }
+
+public:
+  Type type;
+  uint64_t seed;
+  uint64_t pixel_seed;
+  uint32_t index;
+  int dimension;
+};
+
+// The sampler the calling thread is currently rendering with, if any
+inline Sampler *&active_sampler()
+{
+  thread_local Sampler *sampler = nullptr;
+  return sampler;
+}
+
+// Returns the next pair of sample values from the thread's sampler, or two
+// uniform random numbers when it has none.
+inline void sample_2d(double &x, double &y)
+{
+  if(auto sampler = active_sampler()) {
+    sampler->get_2d(x, y);
+  } else {
+    x = random_double();
+    y = random_double();
+  }
+}
+
+inline double sample_1d()
+{
+  if(auto sampler = active_sampler())
+    return sampler->get_1d();
+  return random_double();
+}
+
+#endif
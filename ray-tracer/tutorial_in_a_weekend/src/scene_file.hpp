@@ -0,0 +1,570 @@
+#ifndef SCENE_FILE_HPP
+#define SCENE_FILE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rtweekend.hpp"
+
+#include "linear_bvh.hpp"
+#include "material.hpp"
+#include "moving_sphere.hpp"
+#include "sphere.hpp"
+#include "sphere_set.hpp"
+#include "texture.hpp"
+#include "world.hpp"
+
+// A binary scene file holds what build_world makes out of a world.json, as
+// flat arrays of fixed size records that refer to each other by index. The
+// sections follow the header in this order, each padded to 8 bytes:
+//
+//   TextureRecord[texture_count]    referenced textures come first
+//   MaterialRecord[material_count]
+//   ObjectRecord[object_count]
+//   uint32_t[light_count]           objects that are lights
+//   GroupRecord[group_count]        the objects the accelerator is built over
+//   uint32_t[member_count]          objects of the groups
+//   LinearBvhNode[node_count]       a LinearBvh over the groups
+//   uint32_t[primitive_count]       groups in the BVH's leaves
+//   char[name_bytes]                NUL terminated names
+//
+// Texture and material types are stored as their Type values, so changing
+// those enums means bumping scene_file_version.
+
+const char scene_file_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+const uint32_t scene_file_version = 1;
+const uint32_t no_name = std::numeric_limits<uint32_t>::max();
+
+struct SceneFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;               // 1 if the spheres were grouped into SphereSets
+  uint32_t texture_count;
+  uint32_t material_count;
+  uint32_t object_count;
+  uint32_t light_count;
+  uint32_t group_count;
+  uint32_t member_count;
+  uint32_t node_count;
+  uint32_t primitive_count;
+  uint32_t name_bytes;
+  uint32_t pad;
+  double background[3];
+  double bvh_time0, bvh_time1;  // Shutter interval the BVH was built for
+};
+
+struct TextureRecord {
+  uint32_t type;
+  uint32_t name;
+  uint32_t even, odd;           // Checker
+  double color[3];              // SolidColor
+};
+
+struct MaterialRecord {
+  uint32_t type;
+  uint32_t name;
+  uint32_t texture;             // Lambertian, DiffuseLight
+  uint32_t pad;
+  double color[3];              // Metal
+  double parameter;             // Metal fuzz, Dielectric index of refraction
+};
+
+enum class ObjectKind : uint32_t {Sphere, MovingSphere};
+
+struct ObjectRecord {
+  uint32_t kind;
+  uint32_t name;
+  uint32_t material;
+  uint32_t pad;
+  double center0[3];
+  double center1[3];            // MovingSphere
+  double time0, time1;          // MovingSphere
+  double radius;
+};
+
+// A single object, or a SphereSet of several
+struct GroupRecord {
+  uint32_t first;
+  uint32_t count;
+};
+
+static_assert(sizeof(SceneFileHeader) % 8 == 0, "Scene file sections must stay aligned");
+static_assert(sizeof(TextureRecord) % 8 == 0, "Scene file sections must stay aligned");
+static_assert(sizeof(MaterialRecord) % 8 == 0, "Scene file sections must stay aligned");
+static_assert(sizeof(ObjectRecord) % 8 == 0, "Scene file sections must stay aligned");
+
+inline bool has_extension(const std::string &path, const std::string &extension)
+{
+  return path.size() >= extension.size()
+    && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+// Writes world to path, together with groups, the objects as the
+// accelerator should see them, and a LinearBvh over groups built for the
+// shutter interval [time0, time1]. Returns false, after saying why, if the
+// world holds something the format can't store.
+bool write_scene(
+  const World &world, const HittableList &groups, bool grouped_spheres,
+  const LinearBvh &bvh, double time0, double time1, const std::string &path
+)
+{
+  std::vector<TextureRecord> textures;
+  std::vector<MaterialRecord> materials;
+  std::vector<ObjectRecord> objects;
+  std::vector<uint32_t> lights, members, primitives;
+  std::vector<GroupRecord> group_records;
+  std::string names;
+  std::unordered_map<const void*, uint32_t> index;
+
+  auto add_name = [&](const void *thing) {
+    const auto &name = name_of(world, thing);
+    if(name.empty())
+      return no_name;
+    auto offset = static_cast<uint32_t>(names.size());
+    names += name;
+    names += '\0';
+    return offset;
+  };
+
+  // Textures are added depth first so the ones a checker refers to come
+  // before it
+  std::function<bool(const Texture*)> add_texture = [&](const Texture *texture) {
+    if(index.count(texture))
+      return true;
+    TextureRecord record = {};
+    record.type = static_cast<uint32_t>(texture->type);
+    switch(texture->type) {
+      case Texture::Type::SolidColor: {
+        auto color = static_cast<const SolidColor*>(texture)->color_value;
+        for(int a = 0; a < 3; a++)
+          record.color[a] = color[a];
+        break;
+      }
+      case Texture::Type::Checker: {
+        auto checker = static_cast<const CheckerTexture*>(texture);
+        if(!add_texture(checker->even) || !add_texture(checker->odd))
+          return false;
+        record.even = index[checker->even];
+        record.odd = index[checker->odd];
+        break;
+      }
+      default:
+        std::cerr << "Can't store texture '" << name_of(world, texture) << "' in a scene file" << std::endl;
+        return false;
+    }
+    record.name = add_name(texture);
+    index[texture] = static_cast<uint32_t>(textures.size());
+    textures.push_back(record);
+    return true;
+  };
+
+  auto add_material = [&](const Material *material) {
+    if(index.count(material))
+      return true;
+    MaterialRecord record = {};
+    record.type = static_cast<uint32_t>(material->type);
+    const Texture *texture = nullptr;
+    switch(material->type) {
+      case Material::Type::Lambertian:
+        texture = static_cast<const Lambertian*>(material)->albedo;
+        break;
+      case Material::Type::DiffuseLight:
+        texture = static_cast<const DiffuseLight*>(material)->emit;
+        break;
+      case Material::Type::Metal: {
+        auto metal = static_cast<const Metal*>(material);
+        for(int a = 0; a < 3; a++)
+          record.color[a] = metal->albedo[a];
+        record.parameter = metal->fuzz;
+        break;
+      }
+      case Material::Type::Dielectric:
+        record.parameter = static_cast<const Dielectric*>(material)->ir;
+        break;
+      default:
+        std::cerr << "Can't store material '" << name_of(world, material) << "' in a scene file" << std::endl;
+        return false;
+    }
+    if(texture) {
+      if(!add_texture(texture))
+        return false;
+      record.texture = index[texture];
+    }
+    record.name = add_name(material);
+    index[material] = static_cast<uint32_t>(materials.size());
+    materials.push_back(record);
+    return true;
+  };
+
+  for(auto object : world.objects.objects) {
+    ObjectRecord record = {};
+    Material *material;
+    if(auto sphere = dynamic_cast<const Sphere*>(object)) {
+      record.kind = static_cast<uint32_t>(ObjectKind::Sphere);
+      for(int a = 0; a < 3; a++)
+        record.center0[a] = sphere->center[a];
+      record.radius = sphere->radius;
+      material = sphere->material;
+    } else if(auto moving = dynamic_cast<const MovingSphere*>(object)) {
+      record.kind = static_cast<uint32_t>(ObjectKind::MovingSphere);
+      for(int a = 0; a < 3; a++) {
+        record.center0[a] = moving->center0[a];
+        record.center1[a] = moving->center1[a];
+      }
+      record.time0 = moving->time0;
+      record.time1 = moving->time1;
+      record.radius = moving->radius;
+      material = moving->material;
+    } else {
+      std::cerr << "Can't store object '" << name_of(world, object) << "' in a scene file" << std::endl;
+      return false;
+    }
+    if(!add_material(material))
+      return false;
+    record.material = index[material];
+    record.name = add_name(object);
+    index[object] = static_cast<uint32_t>(objects.size());
+    objects.push_back(record);
+  }
+
+  for(auto light : world.lights.objects) {
+    auto i = index.find(light);
+    if(i == index.end()) {
+      std::cerr << "A light isn't one of the world's objects" << std::endl;
+      return false;
+    }
+    lights.push_back(i->second);
+  }
+
+  std::unordered_map<const Hittable*, uint32_t> group_index;
+  for(auto group : groups.objects) {
+    GroupRecord record = {static_cast<uint32_t>(members.size()), 1};
+    if(auto set = dynamic_cast<const SphereSet*>(group)) {
+      record.count = static_cast<uint32_t>(set->members.size());
+      for(auto member : set->members)
+        members.push_back(index.at(member));
+    } else {
+      members.push_back(index.at(group));
+    }
+    group_index[group] = static_cast<uint32_t>(group_records.size());
+    group_records.push_back(record);
+  }
+  for(auto primitive : bvh.primitives)
+    primitives.push_back(group_index.at(primitive));
+
+  SceneFileHeader header = {};
+  std::memcpy(header.magic, scene_file_magic, sizeof(header.magic));
+  header.version = scene_file_version;
+  header.flags = grouped_spheres ? 1 : 0;
+  header.texture_count = static_cast<uint32_t>(textures.size());
+  header.material_count = static_cast<uint32_t>(materials.size());
+  header.object_count = static_cast<uint32_t>(objects.size());
+  header.light_count = static_cast<uint32_t>(lights.size());
+  header.group_count = static_cast<uint32_t>(group_records.size());
+  header.member_count = static_cast<uint32_t>(members.size());
+  header.node_count = static_cast<uint32_t>(bvh.nodes.size());
+  header.primitive_count = static_cast<uint32_t>(primitives.size());
+  header.name_bytes = static_cast<uint32_t>(names.size());
+  for(int a = 0; a < 3; a++)
+    header.background[a] = world.background[a];
+  header.bvh_time0 = time0;
+  header.bvh_time1 = time1;
+
+  std::ofstream out(path, std::ios::binary);
+  auto write = [&](const void *data, size_t bytes) {
+    const char padding[8] = {0};
+    out.write(static_cast<const char*>(data), bytes);
+    out.write(padding, (8 - bytes % 8) % 8);
+  };
+  write(&header, sizeof(header));
+  write(textures.data(), textures.size() * sizeof(TextureRecord));
+  write(materials.data(), materials.size() * sizeof(MaterialRecord));
+  write(objects.data(), objects.size() * sizeof(ObjectRecord));
+  write(lights.data(), lights.size() * sizeof(uint32_t));
+  write(group_records.data(), group_records.size() * sizeof(GroupRecord));
+  write(members.data(), members.size() * sizeof(uint32_t));
+  write(bvh.nodes.data(), bvh.nodes.size() * sizeof(LinearBvhNode));
+  write(primitives.data(), primitives.size() * sizeof(uint32_t));
+  write(names.data(), names.size());
+
+  if(!out) {
+    std::cerr << "Could not write scene file '" << path << "'" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// A read-only memory mapping of a whole file, unmapped when it goes away
+class MappedFile {
+public:
+  MappedFile(const std::string &path) : data(nullptr), size(0)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+      return;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+      auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p != MAP_FAILED) {
+        data = static_cast<const char*>(p);
+        size = st.st_size;
+      }
+    }
+    close(fd);
+  }
+  ~MappedFile()
+  {
+    if(data)
+      munmap(const_cast<char*>(data), size);
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile &operator=(const MappedFile&) = delete;
+
+public:
+  const char *data;
+  size_t size;
+};
+
+// Whether nodes form a LinearBvh laid out depth first: an interior node's
+// first child follows it and the second starts where the first one's
+// subtree ends, no path is deeper than the traversal stacks allow, and
+// every leaf lies within the primitive_count primitives.
+inline bool valid_bvh(const std::vector<LinearBvhNode> &nodes, uint32_t primitive_count)
+{
+  if(nodes.empty())
+    return true;
+
+  // Subtrees still to check, each covering the nodes [first, end)
+  struct Subtree {
+    uint32_t first, end;
+    int depth;
+  };
+  std::vector<Subtree> pending = {{0, static_cast<uint32_t>(nodes.size()), 1}};
+  while(!pending.empty()) {
+    auto subtree = pending.back();
+    pending.pop_back();
+    if(subtree.depth > LinearBvh::max_depth)
+      return false;
+
+    const auto &node = nodes[subtree.first];
+    if(node.primitive_count > 0) {
+      if(subtree.end != subtree.first + 1
+         || node.primitives_offset > primitive_count
+         || node.primitive_count > primitive_count - node.primitives_offset)
+        return false;
+    } else {
+      auto second = node.second_child_offset;
+      if(second <= subtree.first + 1 || second >= subtree.end)
+        return false;
+      pending.push_back({subtree.first + 1, second, subtree.depth + 1});
+      pending.push_back({second, subtree.end, subtree.depth + 1});
+    }
+  }
+  return true;
+}
+
+// Loads a file written by write_scene into world. Returns false, after
+// saying why, if the file can't be read or is damaged.
+bool read_scene(const std::string &path, World &world)
+{
+  MappedFile file(path);
+  if(!file.data) {
+    std::cerr << "Could not open scene file '" << path << "'" << std::endl;
+    return false;
+  }
+
+  // Hands out the sections in order, pointing straight into the mapping.
+  // The mapping is page aligned and every section 8 byte aligned.
+  size_t offset = 0;
+  bool truncated = false;
+  auto section = [&](size_t count, size_t record_size) -> const char* {
+    auto bytes = count * record_size;
+    // A section ending right at the end of the file leaves its padding,
+    // and so the offset, past the end
+    if(truncated || offset > file.size || bytes > file.size - offset) {
+      truncated = true;
+      return nullptr;
+    }
+    auto p = file.data + offset;
+    offset += bytes + (8 - bytes % 8) % 8;
+    return p;
+  };
+
+  auto header = reinterpret_cast<const SceneFileHeader*>(section(1, sizeof(SceneFileHeader)));
+  if(!header || std::memcmp(header->magic, scene_file_magic, sizeof(scene_file_magic)) != 0) {
+    std::cerr << "'" << path << "' is not a scene file" << std::endl;
+    return false;
+  }
+  if(header->version != scene_file_version) {
+    std::cerr << "Scene file '" << path << "' has version " << header->version
+      << ", expected " << scene_file_version << std::endl;
+    return false;
+  }
+
+  auto textures = reinterpret_cast<const TextureRecord*>(section(header->texture_count, sizeof(TextureRecord)));
+  auto materials = reinterpret_cast<const MaterialRecord*>(section(header->material_count, sizeof(MaterialRecord)));
+  auto objects = reinterpret_cast<const ObjectRecord*>(section(header->object_count, sizeof(ObjectRecord)));
+  auto lights = reinterpret_cast<const uint32_t*>(section(header->light_count, sizeof(uint32_t)));
+  auto groups = reinterpret_cast<const GroupRecord*>(section(header->group_count, sizeof(GroupRecord)));
+  auto members = reinterpret_cast<const uint32_t*>(section(header->member_count, sizeof(uint32_t)));
+  auto nodes = section(header->node_count, sizeof(LinearBvhNode));
+  auto primitives = reinterpret_cast<const uint32_t*>(section(header->primitive_count, sizeof(uint32_t)));
+  auto names = section(header->name_bytes, 1);
+  if(truncated) {
+    std::cerr << "Scene file '" << path << "' is truncated" << std::endl;
+    return false;
+  }
+
+  bool damaged = false;
+  // Whether i refers to one of count records. Anything that refers
+  // elsewhere makes the file damaged, and must not be looked up.
+  auto valid = [&](uint32_t i, uint32_t count) {
+    if(i >= count)
+      damaged = true;
+    return i < count;
+  };
+  auto set_name = [&](const void *thing, uint32_t name) {
+    if(name != no_name && name < header->name_bytes)
+      world.names[thing] = std::string(names + name, strnlen(names + name, header->name_bytes - name));
+  };
+
+  world.background = Color(header->background[0], header->background[1], header->background[2]);
+
+  std::vector<Texture*> texture_list(header->texture_count);
+  for(uint32_t i = 0; i < header->texture_count && !damaged; i++) {
+    const auto &t = textures[i];
+    switch(static_cast<Texture::Type>(t.type)) {
+      case Texture::Type::SolidColor:
+        texture_list[i] = world.arena.create<SolidColor>(Color(t.color[0], t.color[1], t.color[2]));
+        break;
+      case Texture::Type::Checker:
+        if(!valid(t.even, i) || !valid(t.odd, i))
+          continue;
+        texture_list[i] = world.arena.create<CheckerTexture>(texture_list[t.even], texture_list[t.odd]);
+        break;
+      default:
+        damaged = true;
+        continue;
+    }
+    set_name(texture_list[i], t.name);
+  }
+
+  std::vector<Material*> material_list(header->material_count);
+  for(uint32_t i = 0; i < header->material_count && !damaged; i++) {
+    const auto &m = materials[i];
+    switch(static_cast<Material::Type>(m.type)) {
+      case Material::Type::Lambertian:
+        if(!valid(m.texture, header->texture_count))
+          continue;
+        material_list[i] = world.arena.create<Lambertian>(texture_list[m.texture]);
+        break;
+      case Material::Type::DiffuseLight:
+        if(!valid(m.texture, header->texture_count))
+          continue;
+        material_list[i] = world.arena.create<DiffuseLight>(texture_list[m.texture]);
+        break;
+      case Material::Type::Metal:
+        material_list[i] = world.arena.create<Metal>(Color(m.color[0], m.color[1], m.color[2]), m.parameter);
+        break;
+      case Material::Type::Dielectric:
+        material_list[i] = world.arena.create<Dielectric>(m.parameter);
+        break;
+      default:
+        damaged = true;
+        continue;
+    }
+    set_name(material_list[i], m.name);
+  }
+
+  std::vector<Hittable*> object_list(header->object_count);
+  for(uint32_t i = 0; i < header->object_count && !damaged; i++) {
+    const auto &o = objects[i];
+    if(!valid(o.material, header->material_count))
+      continue;
+    auto material = material_list[o.material];
+    switch(static_cast<ObjectKind>(o.kind)) {
+      case ObjectKind::Sphere:
+        object_list[i] = world.arena.create<Sphere>(
+          Point3(o.center0[0], o.center0[1], o.center0[2]), o.radius, material
+        );
+        break;
+      case ObjectKind::MovingSphere:
+        object_list[i] = world.arena.create<MovingSphere>(
+          Point3(o.center0[0], o.center0[1], o.center0[2]),
+          Point3(o.center1[0], o.center1[1], o.center1[2]),
+          o.time0, o.time1, o.radius, material
+        );
+        break;
+      default:
+        damaged = true;
+        continue;
+    }
+    set_name(object_list[i], o.name);
+    world.objects.add(object_list[i]);
+  }
+
+  for(uint32_t i = 0; i < header->light_count && !damaged; i++) {
+    if(valid(lights[i], header->object_count))
+      world.lights.add(object_list[lights[i]]);
+  }
+
+  std::vector<Hittable*> group_list(header->group_count);
+  for(uint32_t i = 0; i < header->group_count && !damaged; i++) {
+    const auto &g = groups[i];
+    if(g.count == 0 || g.first > header->member_count || g.count > header->member_count - g.first) {
+      damaged = true;
+      break;
+    }
+    std::vector<Hittable*> group(g.count);
+    for(uint32_t k = 0; k < g.count && !damaged; k++) {
+      if(!valid(members[g.first + k], header->object_count))
+        break;
+      group[k] = object_list[members[g.first + k]];
+      if(g.count > 1 && !SphereSet::accepts(group[k]))
+        damaged = true;
+    }
+    if(damaged)
+      break;
+    if(g.count == 1)
+      group_list[i] = group[0];
+    else
+      group_list[i] = world.arena.create<SphereSet>(group, header->bvh_time0, header->bvh_time1);
+    world.bvh_objects.add(group_list[i]);
+  }
+
+  std::vector<LinearBvhNode> node_list(header->node_count);
+  if(header->node_count)
+    std::memcpy(node_list.data(), nodes, header->node_count * sizeof(LinearBvhNode));
+  if(!valid_bvh(node_list, header->primitive_count))
+    damaged = true;
+  std::vector<Hittable*> primitive_list(header->primitive_count);
+  for(uint32_t i = 0; i < header->primitive_count && !damaged; i++) {
+    if(valid(primitives[i], header->group_count))
+      primitive_list[i] = group_list[primitives[i]];
+  }
+
+  if(damaged) {
+    std::cerr << "Scene file '" << path << "' is damaged" << std::endl;
+    return false;
+  }
+
+  world.bvh = world.arena.create<LinearBvh>(std::move(node_list), std::move(primitive_list));
+  world.grouped_spheres = header->flags & 1;
+  world.bvh_time0 = header->bvh_time0;
+  world.bvh_time1 = header->bvh_time1;
+  return true;
+}
+
+#endif
@@ -5,29 +5,37 @@
 #include "vec3.hpp"
 #include "onb.hpp"
 #include "pdf.hpp"
+#include "material.hpp"
 
 class Sphere : public Hittable {
 public:
   Sphere() {}
-  Sphere(Point3 cen, double r, Material *m) :
+  Sphere(Point3 cen, real r, Material *m) :
     center(cen), radius(r), material(m) {};
 
   virtual bool hit(
     const Ray &r, double t_min, double t_max, HitRecord &rec
   ) const override;
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
+  virtual void finalize_hit(const Ray &r, HitRecord &rec) const override;
   virtual bool bounding_box(
     double time0, double time1, Aabb &output_box
   ) const override;
   virtual double pdf_value(const Point3& o, const Vec3& v) const override;
   virtual Vec3 random(const Point3& o) const override;
+  virtual double emitted_power() const override;
 
 public:
   Point3 center;
-  double radius;
+  real radius;
   Material *material;
 
 private:
-  static void get_sphere_uv(const Point3 &p, double &u, double &v)
+  // Finds the nearest root of the ray/sphere equation within [t_min, t_max]
+  bool nearest_root(const Ray &r, double t_min, double t_max, real &root) const;
+
+public:
+  static void get_sphere_uv(const Point3 &p, real &u, real &v)
   {
     // p: a given point on the sphere of radius one, centered at the origin.
     // u: returned value [0,1] of angle around the Y axis from X=-1.
@@ -44,7 +52,7 @@ private:
   }
 };
 
-bool Sphere::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const
+bool Sphere::nearest_root(const Ray &r, double t_min, double t_max, real &root) const
 {
   Vec3 oc = r.origin() - center;
   auto a = r.direction().length_squared();
@@ -57,21 +65,39 @@ bool Sphere::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const
   auto sqrtd = sqrt(discriminant);
 
   // Find the nearest root that lies in the acceptable range.
-  auto root = (-half_b - sqrtd) / a;
+  root = (-half_b - sqrtd) / a;
   if(root < t_min || t_max < root) {
     root = (-half_b + sqrtd) / a;
     if(root < t_min || t_max < root)
       return false;
   }
 
-  rec.t = root;
+  return true;
+}
+
+bool Sphere::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const
+{
+  real root;
+  if(!nearest_root(r, t_min, t_max, root))
+    return false;
+
+  rec.defer(root, this);
+  return true;
+}
+
+void Sphere::finalize_hit(const Ray &r, HitRecord &rec) const
+{
   rec.p = r.at(rec.t);
   Vec3 outward_normal = (rec.p - center) / radius;
   rec.set_face_normal(r, outward_normal);
   get_sphere_uv(outward_normal, rec.u, rec.v);
   rec.material = material;
+}
 
-  return true;
+bool Sphere::occluded(const Ray &r, double t_min, double t_max) const
+{
+  real root;
+  return nearest_root(r, t_min, t_max, root);
 }
 
 bool Sphere::bounding_box(double time0, double time1, Aabb &output_box) const
@@ -102,4 +128,8 @@ Vec3 Sphere::random(const Point3& o) const {
     return uvw.local(random_to_sphere(radius, distance_squared));
 }
 
+double Sphere::emitted_power() const {
+  return pi * 4 * pi * radius * radius * luminance(material->emission());
+}
+
 #endif
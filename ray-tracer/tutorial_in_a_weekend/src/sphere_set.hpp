@@ -0,0 +1,387 @@
+#ifndef SPHERE_SET_HPP
+#define SPHERE_SET_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <typeinfo>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "rtweekend.hpp"
+
+#include "arena.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "material.hpp"
+#include "moving_sphere.hpp"
+#include "sphere.hpp"
+
+// Number of spheres a SphereSet tests at once, one per SIMD lane
+#if defined(__AVX__)
+const int sphere_set_lanes = 4;
+#elif defined(__SSE2__)
+const int sphere_set_lanes = 2;
+#else
+const int sphere_set_lanes = 1;
+#endif
+
+// Most spheres grouped into one SphereSet
+const size_t sphere_set_size = 8;
+
+// A group of spheres and moving spheres stored as a structure of arrays, so
+// the ray is tested against sphere_set_lanes of them at a time. A sphere's
+// center at time t is center + (t - time0) * velocity, which is exact for the
+// static ones since their velocity is zero. The arrays are padded to whole
+// lanes with spheres whose center is NaN, which nothing can hit.
+class SphereSet : public Hittable {
+public:
+  // Every member must be a Sphere or a MovingSphere
+  SphereSet(const std::vector<Hittable*> &members, double time0, double time1);
+
+  virtual bool hit(
+    const Ray &r, double t_min, double t_max, HitRecord &rec
+  ) const override;
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
+  virtual void finalize_hit(const Ray &r, HitRecord &rec) const override;
+  virtual bool bounding_box(
+    double time0, double time1, Aabb &output_box
+  ) const override;
+
+  // Whether object can be part of a SphereSet
+  static bool accepts(const Hittable *object);
+
+public:
+  // The spheres the set was made from
+  std::vector<Hittable*> members;
+  size_t count;
+  std::vector<double> center_x, center_y, center_z;
+  std::vector<double> velocity_x, velocity_y, velocity_z;
+  std::vector<double> time0;
+  std::vector<double> radius;
+  std::vector<Material*> materials;
+  Aabb box;
+
+private:
+  void add(const Point3 &center, const Vec3 &velocity, double time, double r, Material *m);
+  Point3 center(size_t i, double time) const;
+
+  // Finds the sphere with the nearest root within [t_min, t_max], or any
+  // sphere with a root in there if first is set. Returns its index, or -1.
+  int nearest(const Ray &r, double t_min, double t_max, bool first, double &root) const;
+};
+
+SphereSet::SphereSet(const std::vector<Hittable*> &members, double time0, double time1)
+  : members(members), count(members.size())
+{
+  bool first = true;
+  for(auto object : members) {
+    if(auto sphere = dynamic_cast<const Sphere*>(object)) {
+      add(sphere->center, Vec3(0, 0, 0), 0, sphere->radius, sphere->material);
+    } else {
+      auto moving = static_cast<const MovingSphere*>(object);
+      auto velocity = (moving->center1 - moving->center0) / (moving->time1 - moving->time0);
+      add(moving->center0, velocity, moving->time0, moving->radius, moving->material);
+    }
+
+    Aabb member_box;
+    object->bounding_box(time0, time1, member_box);
+    box = first ? member_box : surrounding_box(box, member_box);
+    first = false;
+  }
+
+  while(radius.size() % sphere_set_lanes)
+    add(Point3(nan(""), nan(""), nan("")), Vec3(0, 0, 0), 0, 0, nullptr);
+}
+
+void SphereSet::add(const Point3 &center, const Vec3 &velocity, double time, double r, Material *m)
+{
+  center_x.push_back(center.x());
+  center_y.push_back(center.y());
+  center_z.push_back(center.z());
+  velocity_x.push_back(velocity.x());
+  velocity_y.push_back(velocity.y());
+  velocity_z.push_back(velocity.z());
+  time0.push_back(time);
+  radius.push_back(r);
+  materials.push_back(m);
+}
+
+Point3 SphereSet::center(size_t i, double time) const
+{
+  auto dt = time - time0[i];
+  return Point3(
+    center_x[i] + dt * velocity_x[i],
+    center_y[i] + dt * velocity_y[i],
+    center_z[i] + dt * velocity_z[i]
+  );
+}
+
+bool SphereSet::accepts(const Hittable *object)
+{
+  if(auto sphere = dynamic_cast<const Sphere*>(object))
+    return typeid(*sphere) == typeid(Sphere);
+  if(auto moving = dynamic_cast<const MovingSphere*>(object))
+    return typeid(*moving) == typeid(MovingSphere) && moving->time1 != moving->time0;
+  return false;
+}
+
+int SphereSet::nearest(const Ray &r, double t_min, double t_max, bool first, double &root) const
+{
+  const auto o = r.origin();
+  const auto d = r.direction();
+  const auto a = d.length_squared();
+  const auto n = radius.size();
+  int index = -1;
+
+#if defined(__AVX__)
+  const auto ox = _mm256_set1_pd(o.x()), oy = _mm256_set1_pd(o.y()), oz = _mm256_set1_pd(o.z());
+  const auto dx = _mm256_set1_pd(d.x()), dy = _mm256_set1_pd(d.y()), dz = _mm256_set1_pd(d.z());
+  const auto time = _mm256_set1_pd(r.time());
+  const auto va = _mm256_set1_pd(a);
+  const auto lo = _mm256_set1_pd(t_min);
+  const auto sign = _mm256_set1_pd(-0.0);
+  auto hi = _mm256_set1_pd(t_max);
+
+  for(size_t i = 0; i < n; i += 4) {
+    auto dt = _mm256_sub_pd(time, _mm256_loadu_pd(&time0[i]));
+    auto cx = _mm256_add_pd(_mm256_loadu_pd(&center_x[i]), _mm256_mul_pd(dt, _mm256_loadu_pd(&velocity_x[i])));
+    auto cy = _mm256_add_pd(_mm256_loadu_pd(&center_y[i]), _mm256_mul_pd(dt, _mm256_loadu_pd(&velocity_y[i])));
+    auto cz = _mm256_add_pd(_mm256_loadu_pd(&center_z[i]), _mm256_mul_pd(dt, _mm256_loadu_pd(&velocity_z[i])));
+    auto ocx = _mm256_sub_pd(ox, cx);
+    auto ocy = _mm256_sub_pd(oy, cy);
+    auto ocz = _mm256_sub_pd(oz, cz);
+    auto rad = _mm256_loadu_pd(&radius[i]);
+
+    auto half_b = _mm256_add_pd(
+      _mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz)
+    );
+    auto c = _mm256_sub_pd(
+      _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)),
+      _mm256_mul_pd(rad, rad)
+    );
+    auto discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(va, c));
+    auto has_roots = _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ);
+    if(!_mm256_movemask_pd(has_roots))
+      continue;
+
+    auto sqrtd = _mm256_sqrt_pd(discriminant);
+    auto neg_b = _mm256_xor_pd(half_b, sign);
+    auto near_root = _mm256_div_pd(_mm256_sub_pd(neg_b, sqrtd), va);
+    auto far_root = _mm256_div_pd(_mm256_add_pd(neg_b, sqrtd), va);
+    auto near_ok = _mm256_and_pd(
+      has_roots, _mm256_and_pd(_mm256_cmp_pd(near_root, lo, _CMP_GE_OQ), _mm256_cmp_pd(near_root, hi, _CMP_LE_OQ))
+    );
+    auto far_ok = _mm256_and_pd(
+      has_roots, _mm256_and_pd(_mm256_cmp_pd(far_root, lo, _CMP_GE_OQ), _mm256_cmp_pd(far_root, hi, _CMP_LE_OQ))
+    );
+    int mask = _mm256_movemask_pd(_mm256_or_pd(near_ok, far_ok));
+    if(!mask)
+      continue;
+
+    double roots[4];
+    _mm256_storeu_pd(roots, _mm256_blendv_pd(far_root, near_root, near_ok));
+#elif defined(__SSE2__)
+  const auto ox = _mm_set1_pd(o.x()), oy = _mm_set1_pd(o.y()), oz = _mm_set1_pd(o.z());
+  const auto dx = _mm_set1_pd(d.x()), dy = _mm_set1_pd(d.y()), dz = _mm_set1_pd(d.z());
+  const auto time = _mm_set1_pd(r.time());
+  const auto va = _mm_set1_pd(a);
+  const auto lo = _mm_set1_pd(t_min);
+  const auto sign = _mm_set1_pd(-0.0);
+  auto hi = _mm_set1_pd(t_max);
+
+  for(size_t i = 0; i < n; i += 2) {
+    auto dt = _mm_sub_pd(time, _mm_loadu_pd(&time0[i]));
+    auto cx = _mm_add_pd(_mm_loadu_pd(&center_x[i]), _mm_mul_pd(dt, _mm_loadu_pd(&velocity_x[i])));
+    auto cy = _mm_add_pd(_mm_loadu_pd(&center_y[i]), _mm_mul_pd(dt, _mm_loadu_pd(&velocity_y[i])));
+    auto cz = _mm_add_pd(_mm_loadu_pd(&center_z[i]), _mm_mul_pd(dt, _mm_loadu_pd(&velocity_z[i])));
+    auto ocx = _mm_sub_pd(ox, cx);
+    auto ocy = _mm_sub_pd(oy, cy);
+    auto ocz = _mm_sub_pd(oz, cz);
+    auto rad = _mm_loadu_pd(&radius[i]);
+
+    auto half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz));
+    auto c = _mm_sub_pd(
+      _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)),
+      _mm_mul_pd(rad, rad)
+    );
+    auto discriminant = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(va, c));
+    auto has_roots = _mm_cmpge_pd(discriminant, _mm_setzero_pd());
+    if(!_mm_movemask_pd(has_roots))
+      continue;
+
+    auto sqrtd = _mm_sqrt_pd(discriminant);
+    auto neg_b = _mm_xor_pd(half_b, sign);
+    auto near_root = _mm_div_pd(_mm_sub_pd(neg_b, sqrtd), va);
+    auto far_root = _mm_div_pd(_mm_add_pd(neg_b, sqrtd), va);
+    auto near_ok = _mm_and_pd(has_roots, _mm_and_pd(_mm_cmpge_pd(near_root, lo), _mm_cmple_pd(near_root, hi)));
+    auto far_ok = _mm_and_pd(has_roots, _mm_and_pd(_mm_cmpge_pd(far_root, lo), _mm_cmple_pd(far_root, hi)));
+    int mask = _mm_movemask_pd(_mm_or_pd(near_ok, far_ok));
+    if(!mask)
+      continue;
+
+    double roots[2];
+    _mm_storeu_pd(roots, _mm_or_pd(_mm_and_pd(near_ok, near_root), _mm_andnot_pd(near_ok, far_root)));
+#else
+  for(size_t i = 0; i < n; i++) {
+    Vec3 oc = o - center(i, r.time());
+    auto half_b = dot(oc, d);
+    auto c = oc.length_squared() - radius[i] * radius[i];
+    auto discriminant = half_b * half_b - a * c;
+    if(discriminant < 0)
+      continue;
+    auto sqrtd = sqrt(discriminant);
+
+    double roots[1];
+    roots[0] = (-half_b - sqrtd) / a;
+    if(roots[0] < t_min || t_max < roots[0]) {
+      roots[0] = (-half_b + sqrtd) / a;
+      if(roots[0] < t_min || t_max < roots[0])
+        continue;
+    }
+    int mask = 1;
+#endif
+
+    for(int lane = 0; lane < sphere_set_lanes; lane++) {
+      if(!(mask & (1 << lane)) || roots[lane] > t_max)
+        continue;
+      root = t_max = roots[lane];
+      index = static_cast<int>(i) + lane;
+      if(first)
+        return index;
+    }
+#if defined(__AVX__)
+    hi = _mm256_set1_pd(t_max);
+#elif defined(__SSE2__)
+    hi = _mm_set1_pd(t_max);
+#endif
+  }
+
+  return index;
+}
+
+bool SphereSet::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const
+{
+  double root;
+  int index = nearest(r, t_min, t_max, false, root);
+  if(index < 0)
+    return false;
+
+  rec.defer(root, this);
+  rec.primitive = index;
+  return true;
+}
+
+bool SphereSet::occluded(const Ray &r, double t_min, double t_max) const
+{
+  double root;
+  return nearest(r, t_min, t_max, true, root) >= 0;
+}
+
+void SphereSet::finalize_hit(const Ray &r, HitRecord &rec) const
+{
+  auto i = rec.primitive;
+  rec.p = r.at(rec.t);
+  Vec3 outward_normal = (rec.p - center(i, r.time())) / radius[i];
+  rec.set_face_normal(r, outward_normal);
+  Sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+  rec.material = materials[i];
+}
+
+bool SphereSet::bounding_box(double time0, double time1, Aabb &output_box) const
+{
+  output_box = box;
+  return true;
+}
+
+// Splits spheres[start, end) at the median along the longest axis of their
+// centers until at most sphere_set_size are left, and adds those to grouped
+// as a SphereSet
+void group_spheres(
+  std::vector<std::pair<Point3, Hittable*>> &spheres, size_t start, size_t end,
+  double time0, double time1, HittableList &grouped, SceneArena &arena
+)
+{
+  auto count = end - start;
+  if(count == 1) {
+    grouped.add(spheres[start].second);
+    return;
+  }
+  if(count <= sphere_set_size) {
+    std::vector<Hittable*> members;
+    for(size_t i = start; i < end; i++)
+      members.push_back(spheres[i].second);
+    grouped.add(arena.create<SphereSet>(members, time0, time1));
+    return;
+  }
+
+  Point3 lo = spheres[start].first, hi = lo;
+  for(size_t i = start + 1; i < end; i++) {
+    for(int a = 0; a < 3; a++) {
+      lo[a] = fmin(lo[a], spheres[i].first[a]);
+      hi[a] = fmax(hi[a], spheres[i].first[a]);
+    }
+  }
+  auto extent = hi - lo;
+  int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+
+  auto mid = start + count / 2;
+  std::nth_element(
+    spheres.begin() + start, spheres.begin() + mid, spheres.begin() + end,
+    [axis](const auto &a, const auto &b) { return a.first[axis] < b.first[axis]; }
+  );
+  group_spheres(spheres, start, mid, time0, time1, grouped, arena);
+  group_spheres(spheres, mid, end, time0, time1, grouped, arena);
+}
+
+// Replaces the spheres among objects with SphereSets of spheres that lie
+// close together, allocated in arena. Lights are left alone so the light
+// sampler keeps finding them as they are.
+HittableList group_spheres(
+  const HittableList &objects, const HittableList &lights, double time0, double time1, SceneArena &arena
+)
+{
+  std::unordered_set<const Hittable*> light_set(lights.objects.begin(), lights.objects.end());
+  HittableList grouped;
+  std::vector<std::pair<Point3, Hittable*>> spheres;
+  std::vector<Aabb> boxes;
+  std::vector<double> sizes;
+  for(auto object : objects.objects) {
+    Aabb box;
+    if(SphereSet::accepts(object) && !light_set.count(object) && object->bounding_box(time0, time1, box)) {
+      spheres.emplace_back(0.5 * (box.min() + box.max()), object);
+      boxes.push_back(box);
+      sizes.push_back((box.max() - box.min()).length());
+    } else {
+      grouped.add(object);
+    }
+  }
+
+  // A sphere much larger than the rest, like a ground sphere, would stretch
+  // the bounds of its set over everything else, so it stays on its own
+  if(!sizes.empty()) {
+    auto median = sizes.begin() + sizes.size() / 2;
+    std::nth_element(sizes.begin(), median, sizes.end());
+    size_t kept = 0;
+    for(size_t i = 0; i < spheres.size(); i++) {
+      if((boxes[i].max() - boxes[i].min()).length() > 4 * *median)
+        grouped.add(spheres[i].second);
+      else
+        spheres[kept++] = spheres[i];
+    }
+    spheres.resize(kept);
+  }
+  if(spheres.size() < 2)
+    return objects;
+
+  group_spheres(spheres, 0, spheres.size(), time0, time1, grouped, arena);
+  return grouped;
+}
+
+#endif
@@ -11,7 +11,13 @@
 
 class Texture {
 public:
-  void setName(std::string n) {name = n;}
+  // The texture classes defined here, so the hot path can switch on the
+  // type instead of making a virtual call. Anything else is Other.
+  enum class Type {Other, SolidColor, Checker, Noise, Image};
+
+  Texture() : type(Type::Other) {}
+  Texture(Type t) : type(t) {}
+
   virtual Color value(double u, double v, const Point3 &p) const = 0;
   virtual ~Texture() {};
   virtual void serialize(std::ostream &out) const {
@@ -19,7 +25,7 @@ public:
   }
 
 public:
-  std::string name;
+  Type type;
 };
 inline std::ostream& operator<<(std::ostream &out, const Texture &t)
 {
@@ -27,10 +33,10 @@ inline std::ostream& operator<<(std::ostream &out, const Texture &t)
   return out;
 }
 
-class SolidColor : public Texture {
+class SolidColor final : public Texture {
 public:
-  SolidColor() {}
-  SolidColor(Color c) : color_value(c) {}
+  SolidColor() : Texture(Type::SolidColor) {}
+  SolidColor(Color c) : Texture(Type::SolidColor), color_value(c) {}
 
   SolidColor(double red, double green, double blue)
     : SolidColor(Color(red, green, blue)) {}
@@ -54,23 +60,16 @@ public:
 };
 
 
-class CheckerTexture : public Texture {
+class CheckerTexture final : public Texture {
 public:
-  CheckerTexture() {}
+  CheckerTexture() : Texture(Type::Checker) {}
 
   CheckerTexture(Color c1, Color c2)
-    : even(new SolidColor(c1)), odd(new SolidColor(c2)) {}
+    : Texture(Type::Checker), even(new SolidColor(c1)), odd(new SolidColor(c2)) {}
   CheckerTexture(Texture *even, Texture *odd)
-    : even(even), odd(odd) {}
-
-  virtual Color value(double u, double v, const Point3 &p) const override
-  {
-    auto sines = sin(10*p.x())*sin(10*p.y())*sin(10*p.z());
-    if (sines < 0)
-      return odd->value(u, v, p);
-    else
-      return even->value(u, v, p);
-  }
+    : Texture(Type::Checker), even(even), odd(odd) {}
+
+  virtual Color value(double u, double v, const Point3 &p) const override;
   virtual void serialize(std::ostream &out) const override {
     out
       << "CheckerTexture("
@@ -84,11 +83,11 @@ public:
   Texture *odd;
 };
 
-class NoiseTexture : public Texture
+class NoiseTexture final : public Texture
 {
 public:
-  NoiseTexture() {}
-  NoiseTexture(double sc) : scale(sc) {}
+  NoiseTexture() : Texture(Type::Noise) {}
+  NoiseTexture(double sc) : Texture(Type::Noise), scale(sc) {}
 
   virtual Color value(double u, double v, const Point3& p) const override {
     return Color(1, 1, 1) * 0.5 * (1.0 + sin(scale * p.z() + 10*noise.turb(p)));
@@ -100,14 +99,14 @@ public:
   double scale;
 };
 
-class ImageTexture : public Texture {
+class ImageTexture final : public Texture {
 public:
   const static int bytes_per_pixel = 3;
 
   ImageTexture()
-    : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
+    : Texture(Type::Image), data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
 
-  ImageTexture(const char *filename) {
+  ImageTexture(const char *filename) : Texture(Type::Image) {
     auto components_per_pixel = bytes_per_pixel;
 
     data = stbi_load(
@@ -123,7 +122,7 @@ public:
   }
 
   ~ImageTexture() {
-    delete data;
+    stbi_image_free(data);
   }
 
   virtual Color value(double u, double v, const Vec3 &p) const override {
@@ -154,4 +153,31 @@ private:
   int bytes_per_scanline;
 };
 
+// Same as texture->value(u, v, p), but calls the texture classes above
+// directly so the compiler can inline them
+inline Color texture_value(const Texture *texture, double u, double v, const Point3 &p)
+{
+  switch(texture->type) {
+    case Texture::Type::SolidColor:
+      return static_cast<const SolidColor*>(texture)->color_value;
+    case Texture::Type::Checker:
+      return static_cast<const CheckerTexture*>(texture)->value(u, v, p);
+    case Texture::Type::Noise:
+      return static_cast<const NoiseTexture*>(texture)->value(u, v, p);
+    case Texture::Type::Image:
+      return static_cast<const ImageTexture*>(texture)->value(u, v, p);
+    default:
+      return texture->value(u, v, p);
+  }
+}
+
+Color CheckerTexture::value(double u, double v, const Point3 &p) const
+{
+  auto sines = sin(10*p.x())*sin(10*p.y())*sin(10*p.z());
+  if (sines < 0)
+    return texture_value(odd, u, v, p);
+  else
+    return texture_value(even, u, v, p);
+}
+
 #endif
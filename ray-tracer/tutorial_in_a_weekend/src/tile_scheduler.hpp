@@ -0,0 +1,135 @@
+#ifndef TILE_SCHEDULER_HPP
+#define TILE_SCHEDULER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <vector>
+
+// A rectangle of pixels [x0, x1) x [y0, y1)
+struct Tile {
+  int x0, y0;
+  int x1, y1;
+};
+
+// Splits the image into square tiles and hands them out to render threads
+// one at a time. The tiles are ordered up front, and every thread takes
+// the next one as soon as it's done with its last, so the threads keep
+// busy until the very last tiles no matter how uneven they are.
+class TileScheduler {
+public:
+  enum class Order { Scanline, Spiral, Hilbert };
+
+  // tile_size must be at least 1
+  TileScheduler(int width, int height, int tile_size, Order order);
+
+  static bool parse_order(const std::string &name, Order &order)
+  {
+    if(name == "scanline")
+      order = Order::Scanline;
+    else if(name == "spiral")
+      order = Order::Spiral;
+    else if(name == "hilbert")
+      order = Order::Hilbert;
+    else
+      return false;
+    return true;
+  }
+
+  // Claims the next tile, returns false once all tiles have been handed out
+  bool next(Tile &tile)
+  {
+    auto index = next_tile.fetch_add(1, std::memory_order_relaxed);
+    if(index >= tiles.size())
+      return false;
+    tile = tiles[index];
+    return true;
+  }
+
+  size_t size() const { return tiles.size(); }
+
+public:
+  std::vector<Tile> tiles;
+
+private:
+  std::atomic<size_t> next_tile;
+};
+
+// Maps a distance along a Hilbert curve filling an n x n grid, n a power of
+// two, to grid coordinates.
+inline void hilbert_d2xy(int n, int d, int &x, int &y)
+{
+  x = y = 0;
+  for(int s = 1; s < n; s *= 2) {
+    int rx = 1 & (d / 2);
+    int ry = 1 & (d ^ rx);
+    if(ry == 0) {
+      if(rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      std::swap(x, y);
+    }
+    x += s * rx;
+    y += s * ry;
+    d /= 4;
+  }
+}
+
+TileScheduler::TileScheduler(int width, int height, int tile_size, Order order)
+  : next_tile(0)
+{
+  int columns = (width + tile_size - 1) / tile_size;
+  int rows = (height + tile_size - 1) / tile_size;
+
+  auto make_tile = [&](int column, int row) {
+    return Tile{
+      column * tile_size,
+      row * tile_size,
+      std::min((column + 1) * tile_size, width),
+      std::min((row + 1) * tile_size, height)
+    };
+  };
+
+  if(order == Order::Hilbert) {
+    // Walk a curve over the smallest power of two grid covering all tiles
+    // and skip the points that fall outside the image.
+    int n = 1;
+    while(n < columns || n < rows)
+      n *= 2;
+    for(int d = 0; d < n * n; d++) {
+      int column, row;
+      hilbert_d2xy(n, d, column, row);
+      if(column < columns && row < rows)
+        tiles.push_back(make_tile(column, row));
+    }
+    return;
+  }
+
+  for(int row = 0; row < rows; row++) {
+    for(int column = 0; column < columns; column++) {
+      tiles.push_back(make_tile(column, row));
+    }
+  }
+
+  if(order == Order::Spiral) {
+    // Outwards from the centre in rings, each ring walked by angle
+    double cx = 0.5 * (columns - 1);
+    double cy = 0.5 * (rows - 1);
+    auto ring = [&](const Tile &t) {
+      return std::max(fabs(t.x0 / tile_size - cx), fabs(t.y0 / tile_size - cy));
+    };
+    auto angle = [&](const Tile &t) {
+      return atan2(t.y0 / tile_size - cy, t.x0 / tile_size - cx);
+    };
+    std::stable_sort(tiles.begin(), tiles.end(), [&](const Tile &a, const Tile &b) {
+      auto ra = ring(a), rb = ring(b);
+      if(ra != rb)
+        return ra < rb;
+      return angle(a) < angle(b);
+    });
+  }
+}
+
+#endif
@@ -11,15 +11,15 @@ using std::sqrt;
 class Vec3 {
 public:
   Vec3() : e{0,0,0} {}
-  Vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+  Vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
-  double x() const { return e[0]; }
-  double y() const { return e[1]; }
-  double z() const { return e[2]; }
+  real x() const { return e[0]; }
+  real y() const { return e[1]; }
+  real z() const { return e[2]; }
 
   Vec3 operator-() const { return Vec3(-e[0], -e[1], -e[2]); }
-  double operator[](int i) const { return e[i]; }
-  double& operator[](int i) { return e[i]; }
+  real operator[](int i) const { return e[i]; }
+  real& operator[](int i) { return e[i]; }
 
   Vec3& operator+=(const Vec3 &v) {
     e[0] += v.e[0];
@@ -28,22 +28,22 @@ public:
     return *this;
   }
 
-  Vec3& operator*=(const double t) {
+  Vec3& operator*=(const real t) {
     e[0] *= t;
     e[1] *= t;
     e[2] *= t;
     return *this;
   }
 
-  Vec3& operator/=(const double t) {
+  Vec3& operator/=(const real t) {
     return *this *= 1/t;
   }
 
-  double length() const {
+  real length() const {
     return sqrt(length_squared());
   }
 
-  double length_squared() const {
+  real length_squared() const {
     return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
   }
 
@@ -62,7 +62,7 @@ public:
   }
 
 public:
-  double e[3];
+  real e[3];
 };
 
 // Type aliases for Vec3
@@ -90,22 +90,22 @@ inline Vec3 operator*(const Vec3 &u, const Vec3 &v)
   return Vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline Vec3 operator*(double t, const Vec3 &v)
+inline Vec3 operator*(real t, const Vec3 &v)
 {
   return Vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline Vec3 operator*(const Vec3 &v, double t)
+inline Vec3 operator*(const Vec3 &v, real t)
 {
   return t * v;
 }
 
-inline Vec3 operator/(Vec3 v, double t)
+inline Vec3 operator/(Vec3 v, real t)
 {
   return (1/t) * v;
 }
 
-inline double dot(const Vec3 &u, const Vec3 &v)
+inline real dot(const Vec3 &u, const Vec3 &v)
 {
   return (
     u.e[0] * v.e[0]
@@ -154,8 +154,8 @@ Vec3 random_in_hemisphere(const Vec3 &normal)
 }
 
 Vec3 random_cosine_direction() {
-  auto r1 = random_double();
-  auto r2 = random_double();
+  double r1, r2;
+  sample_2d(r1, r2);
   auto z = sqrt(1-r2);
 
   auto phi = 2*pi*r1;
@@ -166,12 +166,24 @@ Vec3 random_cosine_direction() {
 }
 
 Vec3 random_in_unit_disk() {
-  while (true) {
-    auto p = Vec3(random_double(-1, 1), random_double(-1, 1), 0);
-    if (p.length_squared() >= 1)
-      continue;
-    return p;
+  // Concentric mapping (Shirley & Chiu) rather than rejection sampling, so
+  // stratified sample pairs stay stratified on the disk.
+  double a, b;
+  sample_2d(a, b);
+  a = 2 * a - 1;
+  b = 2 * b - 1;
+  if(a == 0 && b == 0)
+    return Vec3(0, 0, 0);
+
+  double r, phi;
+  if(fabs(a) > fabs(b)) {
+    r = a;
+    phi = (pi / 4) * (b / a);
+  } else {
+    r = b;
+    phi = (pi / 2) - (pi / 4) * (a / b);
   }
+  return Vec3(r * cos(phi), r * sin(phi), 0);
 }
 
 Vec3 reflect(const Vec3 &v, const Vec3 &n)
@@ -179,7 +191,7 @@ Vec3 reflect(const Vec3 &v, const Vec3 &n)
   return v - 2*dot(v, n) * n;
 }
 
-Vec3 refract(const Vec3 &uv, const Vec3 &n, double etai_over_etat) {
+Vec3 refract(const Vec3 &uv, const Vec3 &n, real etai_over_etat) {
   auto cos_theta = fmin(dot(-uv, n), 1.0);
   Vec3 r_out_perp =  etai_over_etat * (uv + cos_theta*n);
   Vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
@@ -0,0 +1,290 @@
+#ifndef WAVEFRONT_HPP
+#define WAVEFRONT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.hpp"
+
+#include "camera.hpp"
+#include "integrator.hpp"
+#include "sampler.hpp"
+
+// Number of values in Material::Type
+const int material_type_count = static_cast<int>(Material::Type::Isotropic) + 1;
+
+// A camera sample for the wavefront to trace
+struct CameraSample {
+  int i, j;
+  uint64_t sample_index;
+};
+
+// Rays kept as a structure of arrays, so a stage only streams through the
+// components it uses
+struct RayBuffer {
+  void resize(size_t n)
+  {
+    for(auto component : {&ox, &oy, &oz, &dx, &dy, &dz, &time})
+      component->resize(n);
+  }
+
+  Ray get(size_t k) const
+  {
+    return Ray(Point3(ox[k], oy[k], oz[k]), Vec3(dx[k], dy[k], dz[k]), time[k]);
+  }
+
+  void set(size_t k, const Ray &r)
+  {
+    ox[k] = r.origin().x();
+    oy[k] = r.origin().y();
+    oz[k] = r.origin().z();
+    dx[k] = r.direction().x();
+    dy[k] = r.direction().y();
+    dz[k] = r.direction().z();
+    time[k] = r.time();
+  }
+
+  std::vector<double> ox, oy, oz;
+  std::vector<double> dx, dy, dz;
+  std::vector<double> time;
+};
+
+// Traces a batch of camera samples breadth first. Each bounce runs every
+// live path through one stage before the next one starts: intersect, group
+// the hits by material type, shade, then trace the shadow rays shading
+// queued. Shading goes through the same shade_bounce as ray_color, and every
+// path carries its own random number state, so a sample comes out the same
+// as it would from ray_color.
+class Wavefront {
+public:
+  Wavefront(
+    const Camera &cam,
+    const Hittable &world,
+    const LightSampler &lights,
+    const Color &background,
+    const PathSettings &settings,
+    Sampler::Type sampler_type,
+    uint64_t seed,
+    bool deterministic,
+    int width,
+    int height
+  )
+    : cam(cam), world(world), lights(lights), background(background), settings(settings),
+      sampler_type(sampler_type), seed(seed), deterministic(deterministic),
+      width(width), height(height) {}
+
+  // Traces every sample, writing the radiance of samples[k] to colors[k]
+  void trace(const std::vector<CameraSample> &samples, std::vector<Color> &colors);
+
+private:
+  void generate(const std::vector<CameraSample> &samples);
+  void intersect();
+  void sort_by_material();
+  void shade(int bounce);
+  void trace_shadows();
+
+  // Makes path k's random number state the calling thread's, and saves it
+  // back afterwards
+  void enter(uint32_t k)
+  {
+    thread_rng() = rngs[k];
+    active_sampler() = &samplers[k];
+  }
+  void leave(uint32_t k) { rngs[k] = thread_rng(); }
+
+public:
+  const Camera &cam;
+  const Hittable &world;
+  const LightSampler &lights;
+  const Color background;
+  const PathSettings settings;
+  const Sampler::Type sampler_type;
+  const uint64_t seed;
+  const bool deterministic;
+  const int width, height;
+
+private:
+  // Path state, indexed by the sample's position in the batch
+  RayBuffer rays;
+  std::vector<Color> throughput;
+  std::vector<Color> radiance;
+  std::vector<uint8_t> weigh_emission;
+  std::vector<Point3> scatter_origin;
+  std::vector<double> scatter_pdf;
+  std::vector<Pcg32> rngs;
+  std::vector<Sampler> samplers;
+  std::vector<HitRecord> hits;
+
+  // Paths still being traced, in batch order
+  std::vector<uint32_t> active;
+  // Paths that hit something this bounce, and the same grouped by material
+  std::vector<uint32_t> hit_paths;
+  std::vector<uint32_t> shading_order;
+
+  // Shadow rays queued by shade, and the paths they belong to
+  RayBuffer shadow_rays;
+  std::vector<double> shadow_t_max;
+  std::vector<Color> shadow_contribution;
+  std::vector<uint32_t> shadow_path;
+  size_t shadow_count = 0;
+};
+
+void Wavefront::trace(const std::vector<CameraSample> &samples, std::vector<Color> &colors)
+{
+  const auto n = samples.size();
+  rays.resize(n);
+  throughput.resize(n);
+  radiance.resize(n);
+  weigh_emission.resize(n);
+  scatter_origin.resize(n);
+  scatter_pdf.resize(n);
+  rngs.resize(n);
+  samplers.resize(n);
+  hits.resize(n);
+  shadow_rays.resize(n);
+  shadow_t_max.resize(n);
+  shadow_contribution.resize(n);
+  shadow_path.resize(n);
+
+  // The paths take over the thread's generator and sampler while they run
+  auto own_rng = thread_rng();
+  auto own_sampler = active_sampler();
+
+  generate(samples);
+  for(int bounce = 0; bounce < settings.max_depth && !active.empty(); bounce++) {
+    intersect();
+    sort_by_material();
+    shade(bounce);
+    trace_shadows();
+  }
+
+  thread_rng() = own_rng;
+  active_sampler() = own_sampler;
+
+  colors.resize(n);
+  for(size_t k = 0; k < n; k++)
+    colors[k] = radiance[k];
+}
+
+void Wavefront::generate(const std::vector<CameraSample> &samples)
+{
+  const auto n = samples.size();
+
+  for(size_t k = 0; k < n; k++) {
+    uint64_t pixel = (uint64_t)samples[k].j * width + samples[k].i;
+    if(deterministic) {
+      seed_sample(seed, pixel, samples[k].sample_index);
+      rngs[k] = thread_rng();
+    } else {
+      auto &rng = thread_rng();
+      uint64_t state = (uint64_t)rng.next_uint() << 32 | rng.next_uint();
+      rngs[k].seed(state, pixel);
+    }
+    samplers[k] = Sampler(sampler_type, seed);
+    samplers[k].start_sample(pixel, samples[k].sample_index);
+  }
+
+  active.clear();
+  for(uint32_t k = 0; k < n; k++) {
+    enter(k);
+    double du, dv;
+    samplers[k].get_2d(du, dv);
+    auto u = (samples[k].i + du) / ((double)width - 1);
+    auto v = (samples[k].j + dv) / ((double)height - 1);
+    rays.set(k, cam.get_ray(u, v));
+    leave(k);
+
+    throughput[k] = Color(1, 1, 1);
+    radiance[k] = Color(0, 0, 0);
+    weigh_emission[k] = false;
+    scatter_pdf[k] = 0;
+    active.push_back(k);
+  }
+}
+
+void Wavefront::intersect()
+{
+  hit_paths.clear();
+  thread_counters().rays += active.size();
+  for(auto k : active) {
+    enter(k);
+    auto ray = rays.get(k);
+    auto &rec = hits[k];
+    if(world.hit(ray, 0.001, infinity, rec)) {
+      rec.resolve(ray);
+      hit_paths.push_back(k);
+    } else {
+      radiance[k] += throughput[k] * background;
+    }
+    leave(k);
+  }
+}
+
+void Wavefront::sort_by_material()
+{
+  // Counting sort, stable so each group stays in batch order
+  size_t offsets[material_type_count + 1] = {0};
+  for(auto k : hit_paths)
+    offsets[static_cast<int>(hits[k].material->type) + 1]++;
+  for(int t = 0; t < material_type_count; t++)
+    offsets[t + 1] += offsets[t];
+
+  shading_order.resize(hit_paths.size());
+  for(auto k : hit_paths)
+    shading_order[offsets[static_cast<int>(hits[k].material->type)]++] = k;
+}
+
+void Wavefront::shade(int bounce)
+{
+  active.clear();
+  shadow_count = 0;
+
+  for(auto k : shading_order) {
+    enter(k);
+    PathState path(rays.get(k));
+    path.throughput = throughput[k];
+    path.radiance = radiance[k];
+    path.weigh_emission = weigh_emission[k];
+    path.scatter_origin = scatter_origin[k];
+    path.scatter_pdf = scatter_pdf[k];
+
+    ShadowRay shadow;
+    bool has_shadow;
+    bool alive = shade_bounce(path, hits[k], bounce, lights, settings, shadow, has_shadow);
+    leave(k);
+
+    rays.set(k, path.ray);
+    throughput[k] = path.throughput;
+    radiance[k] = path.radiance;
+    weigh_emission[k] = path.weigh_emission;
+    scatter_origin[k] = path.scatter_origin;
+    scatter_pdf[k] = path.scatter_pdf;
+
+    if(has_shadow) {
+      shadow_rays.set(shadow_count, shadow.ray);
+      shadow_t_max[shadow_count] = shadow.t_max;
+      shadow_contribution[shadow_count] = shadow.contribution;
+      shadow_path[shadow_count] = k;
+      shadow_count++;
+    }
+    if(alive)
+      active.push_back(k);
+  }
+
+  // Back to batch order, which keeps neighbouring pixels' rays together
+  std::sort(active.begin(), active.end());
+}
+
+void Wavefront::trace_shadows()
+{
+  for(size_t q = 0; q < shadow_count; q++) {
+    auto k = shadow_path[q];
+    enter(k);
+    if(!world.occluded(shadow_rays.get(q), 0.001, shadow_t_max[q]))
+      radiance[k] += shadow_contribution[q];
+    leave(k);
+  }
+}
+
+#endif
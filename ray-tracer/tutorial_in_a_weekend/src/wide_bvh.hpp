@@ -0,0 +1,439 @@
+#ifndef WIDE_BVH_HPP
+#define WIDE_BVH_HPP
+
+#include <cstdint>
+#include <vector>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "rtweekend.hpp"
+
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "linear_bvh.hpp"
+
+// Number of children per WideBvh node, one per SSE lane
+const int wide_bvh_width = 4;
+
+// Entries the traversal stacks need. A WideBvh is no deeper than the
+// LinearBvh it was collapsed from, as each of its levels spans at least one
+// binary level, and visiting an interior node pops it and pushes at most
+// wide_bvh_width children: at most 3 more entries per level.
+const int wide_bvh_stack_size = (wide_bvh_width - 1) * LinearBvh::max_depth + 1;
+
+// A node of a WideBvh. The child boxes are stored as structure-of-arrays so
+// that all four can be slab tested at once: bounds[0] holds the minimum and
+// bounds[1] the maximum corner, indexed by axis and then by child.
+struct alignas(64) WideBvhNode {
+  float bounds[2][3][wide_bvh_width];
+  // Index of the child node, or the first primitive if the child is a leaf
+  int32_t child[wide_bvh_width];
+  // Number of primitives in a leaf child, 0 for interior or empty children
+  uint16_t count[wide_bvh_width];
+
+  bool is_empty(int i) const { return child[i] < 0; }
+  bool is_leaf(int i) const { return count[i] > 0; }
+};
+
+// A four-wide BVH built by collapsing the binary tree of a LinearBvh. Every
+// traversal step tests the ray against four child boxes with SSE.
+class WideBvh : public Hittable {
+public:
+  WideBvh(const HittableList &list, double time0, double time1);
+  // Collapses an existing binary tree
+  WideBvh(const LinearBvh &binary, double time0, double time1);
+
+  virtual bool hit(
+    const Ray &r, double t_min, double t_max, HitRecord &rec
+  ) const override;
+
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
+
+  virtual void hit_packet(
+    const RayPacket &packet, double t_min, double t_max, HitRecord recs[], bool hits[]
+  ) const override;
+
+  virtual bool bounding_box(
+    double time0, double time1, Aabb &output_box
+  ) const override;
+
+public:
+  std::vector<WideBvhNode> nodes;
+  std::vector<Hittable*> primitives;
+  Aabb box;
+  bool has_box;
+
+private:
+  int32_t collapse(const std::vector<LinearBvhNode> &binary, uint32_t index);
+  int hit_children(
+    const WideBvhNode &node,
+    const float origin[3], const float inv_dir[3], const int dir_is_neg[3],
+    float t_min, float t_max, float t_near[wide_bvh_width]
+  ) const;
+  // hit_children for ray k of a packet
+  int hit_children(
+    const WideBvhNode &node, const PacketTraversal &traversal, int k, float t_near[wide_bvh_width]
+  ) const;
+};
+
+WideBvh::WideBvh(const HittableList &list, double time0, double time1)
+  : WideBvh(LinearBvh(list, time0, time1), time0, time1) {}
+
+WideBvh::WideBvh(const LinearBvh &binary, double time0, double time1)
+{
+  primitives = binary.primitives;
+  has_box = binary.bounding_box(time0, time1, box);
+  if(binary.nodes.empty())
+    return;
+
+  collapse(binary.nodes, 0);
+}
+
+int32_t WideBvh::collapse(const std::vector<LinearBvhNode> &binary, uint32_t index)
+{
+  // Gather up to four descendants of the binary node, always opening up the
+  // interior node with the largest surface area as it's the most likely to
+  // be hit.
+  uint32_t open[wide_bvh_width];
+  int open_count = 0;
+
+  if(binary[index].primitive_count > 0) {
+    open[open_count++] = index;
+  } else {
+    open[open_count++] = index + 1;
+    open[open_count++] = binary[index].second_child_offset;
+  }
+
+  while(open_count < wide_bvh_width) {
+    int best = -1;
+    float best_area = -1;
+    for(int i = 0; i < open_count; i++) {
+      const auto &n = binary[open[i]];
+      if(n.primitive_count > 0)
+        continue;
+      auto dx = n.bounds_max[0] - n.bounds_min[0];
+      auto dy = n.bounds_max[1] - n.bounds_min[1];
+      auto dz = n.bounds_max[2] - n.bounds_min[2];
+      auto area = dx * dy + dx * dz + dy * dz;
+      if(area > best_area) {
+        best_area = area;
+        best = i;
+      }
+    }
+    if(best < 0)
+      break;
+
+    auto opened = open[best];
+    open[best] = opened + 1;
+    open[open_count++] = binary[opened].second_child_offset;
+  }
+
+  auto offset = static_cast<int32_t>(nodes.size());
+  nodes.emplace_back();
+
+  WideBvhNode wide;
+  for(int i = 0; i < wide_bvh_width; i++) {
+    for(int a = 0; a < 3; a++) {
+      wide.bounds[0][a][i] = std::numeric_limits<float>::infinity();
+      wide.bounds[1][a][i] = -std::numeric_limits<float>::infinity();
+    }
+    wide.child[i] = -1;
+    wide.count[i] = 0;
+  }
+
+  for(int i = 0; i < open_count; i++) {
+    const auto &n = binary[open[i]];
+    for(int a = 0; a < 3; a++) {
+      wide.bounds[0][a][i] = n.bounds_min[a];
+      wide.bounds[1][a][i] = n.bounds_max[a];
+    }
+    if(n.primitive_count > 0) {
+      wide.child[i] = static_cast<int32_t>(n.primitives_offset);
+      wide.count[i] = n.primitive_count;
+    } else {
+      wide.child[i] = collapse(binary, open[i]);
+    }
+  }
+
+  nodes[offset] = wide;
+  return offset;
+}
+
+bool WideBvh::bounding_box(double time0, double time1, Aabb &output_box) const
+{
+  output_box = box;
+  return has_box;
+}
+
+// Slab tests the ray against all children of a node. Returns a bit mask of
+// the children that were hit and their entry distances in t_near.
+inline int WideBvh::hit_children(
+  const WideBvhNode &node,
+  const float origin[3], const float inv_dir[3], const int dir_is_neg[3],
+  float t_min, float t_max, float t_near[wide_bvh_width]
+) const
+{
+#ifdef __SSE__
+  auto t0 = _mm_set1_ps(t_min);
+  auto t1 = _mm_set1_ps(t_max);
+  for(int a = 0; a < 3; a++) {
+    auto o = _mm_set1_ps(origin[a]);
+    auto inv = _mm_set1_ps(inv_dir[a]);
+    // Picking the near and far planes from the direction sign avoids a swap
+    auto near_plane = _mm_load_ps(node.bounds[dir_is_neg[a]][a]);
+    auto far_plane = _mm_load_ps(node.bounds[1 - dir_is_neg[a]][a]);
+    auto near_t = _mm_mul_ps(_mm_sub_ps(near_plane, o), inv);
+    auto far_t = _mm_mul_ps(_mm_sub_ps(far_plane, o), inv);
+    // The running interval is the second operand so NaNs leave it unchanged
+    t0 = _mm_max_ps(near_t, t0);
+    t1 = _mm_min_ps(far_t, t1);
+  }
+  _mm_storeu_ps(t_near, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+  int mask = 0;
+  for(int i = 0; i < wide_bvh_width; i++) {
+    auto t0 = t_min;
+    auto t1 = t_max;
+    for(int a = 0; a < 3; a++) {
+      auto near_t = (node.bounds[dir_is_neg[a]][a][i] - origin[a]) * inv_dir[a];
+      auto far_t = (node.bounds[1 - dir_is_neg[a]][a][i] - origin[a]) * inv_dir[a];
+      t0 = near_t > t0 ? near_t : t0;
+      t1 = far_t < t1 ? far_t : t1;
+    }
+    t_near[i] = t0;
+    if(t0 <= t1)
+      mask |= 1 << i;
+  }
+  return mask;
+#endif
+}
+
+inline int WideBvh::hit_children(
+  const WideBvhNode &node, const PacketTraversal &traversal, int k, float t_near[wide_bvh_width]
+) const
+{
+  float origin[3], inv_dir[3];
+  int dir_is_neg[3];
+  for(int a = 0; a < 3; a++) {
+    origin[a] = traversal.origin[a][k];
+    inv_dir[a] = traversal.inv_dir[a][k];
+    dir_is_neg[a] = inv_dir[a] < 0;
+  }
+  return hit_children(node, origin, inv_dir, dir_is_neg, traversal.t_lower, traversal.t_upper[k], t_near);
+}
+
+bool WideBvh::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const
+{
+  if(nodes.empty())
+    return false;
+
+  float origin[3], inv_dir[3];
+  int dir_is_neg[3];
+  for(int a = 0; a < 3; a++) {
+    origin[a] = static_cast<float>(r.origin()[a]);
+    inv_dir[a] = static_cast<float>(r.inv_dir[a]);
+    dir_is_neg[a] = r.sign[a];
+  }
+
+  const float t_lower = round_down(t_min);
+  float t_upper = round_up(t_max) * 1.0000008f;
+
+  struct StackEntry {
+    int32_t child;
+    uint16_t count;
+    float t_near;
+  };
+  StackEntry stack[wide_bvh_stack_size];
+  int stack_size = 0;
+  stack[stack_size++] = {0, 0, t_lower};
+
+  bool hit_anything = false;
+
+  while(stack_size) {
+    auto entry = stack[--stack_size];
+    if(entry.t_near > t_upper)
+      continue;
+
+    if(entry.count > 0) {
+      for(int i = 0; i < entry.count; i++) {
+        if(primitives[entry.child + i]->hit(r, t_min, t_max, rec)) {
+          hit_anything = true;
+          t_max = rec.t;
+          t_upper = round_up(t_max) * 1.0000008f;
+        }
+      }
+      continue;
+    }
+
+    const auto &node = nodes[entry.child];
+    float t_near[wide_bvh_width];
+    int mask = hit_children(node, origin, inv_dir, dir_is_neg, t_lower, t_upper, t_near);
+
+    // Push the children far to near so the nearest is popped first
+    StackEntry hits[wide_bvh_width];
+    int hit_count = 0;
+    for(int i = 0; i < wide_bvh_width; i++) {
+      if(!(mask & (1 << i)) || node.is_empty(i))
+        continue;
+      StackEntry e = {node.child[i], node.count[i], t_near[i]};
+      int j = hit_count++;
+      while(j > 0 && hits[j - 1].t_near < e.t_near) {
+        hits[j] = hits[j - 1];
+        j--;
+      }
+      hits[j] = e;
+    }
+    for(int i = 0; i < hit_count; i++)
+      stack[stack_size++] = hits[i];
+  }
+
+  return hit_anything;
+}
+
+bool WideBvh::occluded(const Ray &r, double t_min, double t_max) const
+{
+  if(nodes.empty())
+    return false;
+
+  float origin[3], inv_dir[3];
+  int dir_is_neg[3];
+  for(int a = 0; a < 3; a++) {
+    origin[a] = static_cast<float>(r.origin()[a]);
+    inv_dir[a] = static_cast<float>(r.inv_dir[a]);
+    dir_is_neg[a] = r.sign[a];
+  }
+
+  const float t_lower = round_down(t_min);
+  const float t_upper = round_up(t_max) * 1.0000008f;
+
+  // Any intersection will do, so children are pushed unsorted
+  struct StackEntry {
+    int32_t child;
+    uint16_t count;
+  };
+  StackEntry stack[wide_bvh_stack_size];
+  int stack_size = 0;
+  stack[stack_size++] = {0, 0};
+
+  while(stack_size) {
+    auto entry = stack[--stack_size];
+
+    if(entry.count > 0) {
+      for(int i = 0; i < entry.count; i++) {
+        if(primitives[entry.child + i]->occluded(r, t_min, t_max))
+          return true;
+      }
+      continue;
+    }
+
+    const auto &node = nodes[entry.child];
+    float t_near[wide_bvh_width];
+    int mask = hit_children(node, origin, inv_dir, dir_is_neg, t_lower, t_upper, t_near);
+    for(int i = 0; i < wide_bvh_width; i++) {
+      if((mask & (1 << i)) && !node.is_empty(i))
+        stack[stack_size++] = {node.child[i], node.count[i]};
+    }
+  }
+
+  return false;
+}
+
+void WideBvh::hit_packet(
+  const RayPacket &packet, double t_min, double t_max, HitRecord recs[], bool hits[]
+) const
+{
+  for(int k = 0; k < packet.size; k++)
+    hits[k] = false;
+  if(nodes.empty())
+    return;
+
+  PacketTraversal traversal(packet, t_min, t_max);
+  double t_closest[max_packet_size];
+  for(int k = 0; k < packet.size; k++)
+    t_closest[k] = t_max;
+
+  // Leaves are pushed with the node and slot they hang off, so rays after
+  // the first can still be tested against their box.
+  struct StackEntry {
+    int32_t child;
+    uint16_t count;
+    uint8_t slot;
+    int32_t parent;
+    int first;
+    float t_near;
+  };
+  StackEntry stack[wide_bvh_stack_size];
+  int stack_size = 0;
+  stack[stack_size++] = {0, 0, 0, -1, 0, traversal.t_lower};
+
+  while(stack_size) {
+    auto entry = stack[--stack_size];
+
+    if(entry.count > 0) {
+      // Rays may have found closer hits since the leaf was pushed, so only
+      // the first ray's entry distance can be trusted without a retest
+      const auto &parent = nodes[entry.parent];
+      for(int k = entry.first; k < packet.size; k++) {
+        float t_near[wide_bvh_width];
+        bool reaches = k == entry.first
+          ? entry.t_near <= traversal.t_upper[k]
+          : (hit_children(parent, traversal, k, t_near) & (1 << entry.slot)) != 0;
+        if(!reaches)
+          continue;
+        for(int i = 0; i < entry.count; i++) {
+          if(primitives[entry.child + i]->hit(packet.rays[k], t_min, t_closest[k], recs[k])) {
+            hits[k] = true;
+            t_closest[k] = recs[k].t;
+            traversal.shorten(k, t_closest[k]);
+          }
+        }
+      }
+      continue;
+    }
+
+    // Find the first ray to reach each child, trying later rays only for
+    // the children the packet as a whole might reach
+    const auto &node = nodes[entry.child];
+    int pending = 0;
+    for(int i = 0; i < wide_bvh_width; i++) {
+      if(node.is_empty(i))
+        continue;
+      float bounds_min[3], bounds_max[3];
+      for(int a = 0; a < 3; a++) {
+        bounds_min[a] = node.bounds[0][a][i];
+        bounds_max[a] = node.bounds[1][a][i];
+      }
+      if(traversal.may_hit(bounds_min, bounds_max))
+        pending |= 1 << i;
+    }
+
+    StackEntry hits_found[wide_bvh_width];
+    int hit_count = 0;
+    for(int k = entry.first; k < packet.size && pending; k++) {
+      float t_near[wide_bvh_width];
+      int mask = hit_children(node, traversal, k, t_near) & pending;
+      pending &= ~mask;
+      for(int i = 0; i < wide_bvh_width; i++) {
+        if(!(mask & (1 << i)))
+          continue;
+        StackEntry e = {
+          node.child[i], node.count[i], static_cast<uint8_t>(i), entry.child, k, t_near[i]
+        };
+        // Far to near so the nearest is popped first
+        int j = hit_count++;
+        while(j > 0 && hits_found[j - 1].t_near < e.t_near) {
+          hits_found[j] = hits_found[j - 1];
+          j--;
+        }
+        hits_found[j] = e;
+      }
+    }
+    for(int i = 0; i < hit_count; i++)
+      stack[stack_size++] = hits_found[i];
+  }
+}
+
+#endif
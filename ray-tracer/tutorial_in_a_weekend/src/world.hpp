@@ -0,0 +1,47 @@
+#ifndef WORLD_HPP
+#define WORLD_HPP
+
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#include "rtweekend.hpp"
+
+#include "arena.hpp"
+#include "hittable_list.hpp"
+#include "linear_bvh.hpp"
+#include "material.hpp"
+#include "texture.hpp"
+
+typedef struct {
+  // Owns every texture, material and object below; the rest only refer to
+  // them
+  SceneArena arena;
+  Color background;
+  std::map<std::string, Texture*> texture_list;
+  std::map<std::string, Material*> material_list;
+  std::map<std::string, Hittable*> object_list;
+  HittableList objects;
+  HittableList lights;
+  // Names of the textures, materials and objects above, kept out of the
+  // objects themselves so the ones the renderer touches stay small
+  std::unordered_map<const void*, std::string> names;
+
+  // Set by binary scene files, which come with the objects already grouped
+  // into SphereSets (if grouped_spheres) and a LinearBvh over those built
+  // for the shutter interval [bvh_time0, bvh_time1]
+  LinearBvh *bvh = nullptr;
+  HittableList bvh_objects;
+  bool grouped_spheres = false;
+  double bvh_time0 = 0, bvh_time1 = 0;
+} World;
+
+// The name thing was given in the world file, or "" if it has none
+const std::string &name_of(const World &world, const void *thing)
+{
+  static const std::string unnamed;
+  auto name = world.names.find(thing);
+  return name != world.names.end() ? name->second : unnamed;
+}
+
+#endif
@@ -0,0 +1,69 @@
+# Renders tests/rejections with every render path and checks that the images
+# are identical. The lamp is brighter than MAX_COLOR, so every path that sees
+# it is rejected and traced again, and the paths only agree if they retry
+# the same way.
+#
+#   cmake -DRAYTRACER=... -DSOURCE_DIR=... -DWORK_DIR=... -P compare_modes.cmake
+
+set(scene "${SOURCE_DIR}/tests/rejections")
+set(variants megakernel_packets megakernel_single wavefront)
+
+foreach(variant ${variants})
+  if(variant STREQUAL "wavefront")
+    set(mode "wavefront")
+    set(packet_size 16)
+  elseif(variant STREQUAL "megakernel_single")
+    set(mode "megakernel")
+    set(packet_size 0)
+  else()
+    set(mode "megakernel")
+    set(packet_size 16)
+  endif()
+
+  # The renderer reads its settings from the parent of the directory it is
+  # run in
+  set(dir "${WORK_DIR}/${variant}")
+  file(REMOVE_RECURSE "${dir}")
+  file(MAKE_DIRECTORY "${dir}/run")
+  file(COPY "${scene}/camera.json" DESTINATION "${dir}")
+  file(WRITE "${dir}/render.json" "{
+    \"width\": 48,
+    \"height\": 32,
+    \"min_samples_per_pixel\": 16,
+    \"max_samples_per_pixel\": 256,
+    \"max_depth\": 8,
+    \"pincer_limit\": 0.05,
+    \"world\": \"${scene}/world.json\",
+    \"mode\": \"${mode}\",
+    \"wavefront_size\": 256,
+    \"packet_size\": ${packet_size},
+    \"tile_size\": 8,
+    \"threads\": 2,
+    \"deterministic\": true,
+    \"seed\": 1
+}
+")
+
+  execute_process(
+    COMMAND "${RAYTRACER}" "${variant}.png"
+    WORKING_DIRECTORY "${dir}/run"
+    RESULT_VARIABLE result
+    OUTPUT_QUIET
+    ERROR_QUIET
+  )
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Rendering ${variant} failed: ${result}")
+  endif()
+endforeach()
+
+foreach(variant ${variants})
+  execute_process(
+    COMMAND ${CMAKE_COMMAND} -E compare_files
+      "${WORK_DIR}/megakernel_packets/run/megakernel_packets.png"
+      "${WORK_DIR}/${variant}/run/${variant}.png"
+    RESULT_VARIABLE result
+  )
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${variant} renders a different image than megakernel_packets")
+  endif()
+endforeach()